@@ -0,0 +1,116 @@
+/*************************************************/
+/*          NebulaBrot Search Cascade Check      */
+/*************************************************/
+
+// Measures what the double precision first pass of the search buys and
+// what it costs. The same draws are searched with and without the cascade
+// on one thread, the orbits each accepts traced into a histogram of its
+// own, and the two histograms compared pixel by pixel.
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "internal.h"
+
+static double searchDraws(nebula_context *context, long long *histogram, long batches, long *accepted);
+static long promotedDraws(nebula_context *context, long batches);
+
+
+int nebulaCheckCascade(const nebula_params *params, long draws, nebula_cascade_check *check){
+   render_params job = *params;
+   size_t cells = nebulaHistogramLength(params), pixels = cells / CHANNELS, pixel;
+   long long *reference = calloc(cells, sizeof(long long));
+   long long *histogram = calloc(cells, sizeof(long long));
+   nebula_context *plain = NULL, *cascade = NULL;
+   long batches = (draws + SEARCH_BATCH - 1) / SEARCH_BATCH;
+   long long difference = 0, total = 0;
+   long identical = 0;
+   int channel, same;
+
+   memset(check, 0, sizeof(*check));
+   job.importance = FALSE;
+   job.verbose = FALSE;
+   job.seed = params->seed ? params->seed : 1;
+   if(reference != NULL && histogram != NULL && nebulaValidParams(&job)){
+      job.cascade = FALSE;
+      plain = nebulaCreate(&job, reference);
+      job.cascade = TRUE;
+      cascade = nebulaCreate(&job, histogram);
+   }
+   if(plain == NULL || cascade == NULL || batches <= 0){
+      nebulaDestroy(plain);
+      nebulaDestroy(cascade);
+      free(reference);
+      free(histogram);
+      return FALSE;
+   }
+
+   check->draws = batches * SEARCH_BATCH;
+   check->reference_seconds = searchDraws(plain, reference, batches, &check->reference_accepted);
+   check->cascade_seconds = searchDraws(cascade, histogram, batches, &check->accepted);
+   check->promoted = promotedDraws(plain, batches);
+   check->missed = check->reference_accepted - check->accepted;
+
+   for(pixel = 0; pixel < pixels; pixel++){
+      for(same = TRUE, channel = 0; channel < CHANNELS; channel++){
+         long long a = reference[pixel * CHANNELS + channel], b = histogram[pixel * CHANNELS + channel];
+         same &= a == b;
+         difference += a > b ? a - b : b - a;
+         total += a;
+      }
+      identical += same;
+   }
+   check->pixel_agreement = (double)identical / pixels;
+   check->hit_difference = total > 0 ? (double)difference / total : 0;
+
+   nebulaDestroy(plain);
+   nebulaDestroy(cascade);
+   free(reference);
+   free(histogram);
+   return TRUE;
+}
+
+// Seconds the context's search kernel takes over batches from the job's
+// seed. The accepted orbits are traced into the histogram untimed.
+static double searchDraws(nebula_context *context, long long *histogram, long batches, long *accepted){
+   candidate orbits[SEARCH_BATCH];
+   unsigned long long seed = context->params.seed;
+   double seconds = 0, start;
+   long batch;
+   int found, i;
+
+   nebSequenceInit(context, &seed);
+   for(batch = 0; batch < batches; batch++){
+      start = nebWallClock();
+      found = context->kernel->searchBatch(context, &seed, orbits);
+      seconds += nebWallClock() - start;
+      for(i = 0; i < found; i++){
+         context->kernel->orbitTrace(context, &orbits[i], histogram);
+      }
+      *accepted += found;
+   }
+   return seconds;
+}
+
+// Draws of the same batches the double precision pass hands on to long double
+static long promotedDraws(nebula_context *context, long batches){
+   neb_complex coords[SEARCH_BATCH];
+   double weights[SEARCH_BATCH];
+   unsigned long long seed = context->params.seed;
+   const render_params *params = &context->params;
+   long batch, promoted = 0;
+   int draws[SEARCH_BATCH], count, i;
+
+   nebSequenceInit(context, &seed);
+   for(batch = 0; batch < batches; batch++){
+      nebSampleBatch(context, &seed, coords, weights);
+      for(count = 0, i = 0; i < SEARCH_BATCH; i++){
+         if(nebCheckExclusions(coords[i], params->exclusions) == TRUE){
+            draws[count++] = i;
+         }
+      }
+      promoted += nebCascadeFilter(coords, draws, count, params->min_orbital_length,
+         params->max_orbital_length, FALSE);
+   }
+   return promoted;
+}
@@ -0,0 +1,794 @@
+/*************************************************/
+/*           NebulaBrot Command Line             */
+/*************************************************/
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <math.h>
+#include <getopt.h>
+#include <pthread.h>
+
+#include "cli.h"
+#include "daemon.h"
+
+#define TRUE 1
+#define FALSE 0
+
+// Sampling benchmark: the reference image is rendered from this many times
+// the benchmarked sample count, which leaves it a sixteenth of the noise,
+// and each sampler is averaged over the trials
+#define BENCHMARK_REFERENCE_FACTOR 256
+#define BENCHMARK_TRIALS 3
+
+// Tile size of --pyramid output
+#define PYRAMID_TILE 256
+
+// Image written by a render
+#define FORMAT_BMP 0
+#define FORMAT_PNG 1
+#define FORMAT_PNG16 2
+#define FORMAT_PYRAMID 3
+
+// What nebulaMain() does with the job
+#define MODE_RENDER 0
+#define MODE_BENCHMARK_SAMPLING 1
+#define MODE_SERVE 2
+#define MODE_MERGE 3
+#define MODE_BENCHMARK_SCATTER 4
+#define MODE_SURVEY 5
+#define MODE_BENCHMARK_CASCADE 6
+
+// Stratified points tested by --survey
+#define SURVEY_PROBES 65536
+
+// Draws searched both ways by --benchmark-cascade
+#define CASCADE_DRAWS (1 << 20)
+
+// What the command line asks for beyond the job itself
+typedef struct _cli_options {
+   const char *output;
+   int mode;
+   int format;
+   const char *socket_path;
+   double delta_interval;        // Seconds between delta exports, 0 for none
+   const char *aggregate;        // Histogram file deltas are merged into
+   char **deltas;
+   int delta_count;
+   const char *survivors;        // Survivors table to keep
+   const char *resume;           // Survivors table to carry on
+   const char *histogram;        // Histogram file the render is added to
+} cli_options;
+
+// Exports deltas of a render every interval while it samples
+typedef struct _delta_exporter {
+   pthread_t thread;
+   int started;
+   nebula_context *context;
+   nebula_delta *delta;
+   const char *basename;
+   double interval;
+   int exports;
+   long last_samples;
+   int done;
+   pthread_mutex_t lock;
+   pthread_cond_t wake;
+} delta_exporter;
+
+static int parseArgs(int argc, char* argv[], nebula_params *params, cli_options *cli);
+static void usage(const char *program, const nebula_params *defaults);
+static int render(const nebula_params *params, const cli_options *cli);
+static int writeImage(const long long *histogram, int width, int height, const char *filename,
+   const char *basename, int format, int threads);
+static void *deltaExporter(void *arg);
+static int exportDelta(delta_exporter *exporter);
+static int mergeDeltas(const nebula_params *params, const cli_options *cli);
+static int benchmarkSampling(const nebula_params *params);
+static int benchmarkScatter(const nebula_params *params);
+static int surveyJob(const nebula_params *params);
+static int benchmarkCascade(const nebula_params *params);
+static double histogramError(const nebula_params *params, const long long *estimate, const long long *reference);
+
+
+int nebulaMain(int argc, char* argv[], const nebula_params *defaults, const char *output){
+   nebula_params params = *defaults;
+   cli_options cli = {output, MODE_RENDER, FORMAT_BMP, NULL, 0, NULL, NULL, 0, NULL, NULL, NULL};
+   char filename[50];
+
+   params.verbose = TRUE;
+   if(parseArgs(argc, argv, &params, &cli) == FALSE || nebulaValidParams(&params) == FALSE){
+      usage(argv[0], defaults);
+      return EXIT_FAILURE;
+   }
+   if(cli.output == NULL){
+      int timestamp = (unsigned)time(NULL);
+      sprintf(filename, "%d", timestamp);
+      strcat(filename, cli.format == FORMAT_PNG || cli.format == FORMAT_PNG16 ? ".png" : ".bmp");
+      cli.output = filename;
+   }
+   if(cli.format == FORMAT_BMP && strrchr(cli.output, '.') && strcmp(strrchr(cli.output, '.'), ".png") == 0){
+      cli.format = FORMAT_PNG;
+   }
+
+   if(cli.mode == MODE_SERVE){
+      return nebulaServe(cli.socket_path, &params);
+   }
+   if(cli.mode == MODE_BENCHMARK_SAMPLING){
+      return benchmarkSampling(&params) ? EXIT_SUCCESS : EXIT_FAILURE;
+   }
+   if(cli.mode == MODE_SURVEY){
+      return surveyJob(&params) ? EXIT_SUCCESS : EXIT_FAILURE;
+   }
+   if(cli.mode == MODE_BENCHMARK_SCATTER){
+      return benchmarkScatter(&params) ? EXIT_SUCCESS : EXIT_FAILURE;
+   }
+   if(cli.mode == MODE_BENCHMARK_CASCADE){
+      return benchmarkCascade(&params) ? EXIT_SUCCESS : EXIT_FAILURE;
+   }
+   if(cli.mode == MODE_MERGE){
+      return mergeDeltas(&params, &cli) ? EXIT_SUCCESS : EXIT_FAILURE;
+   }
+   return render(&params, &cli) ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+static int parseArgs(int argc, char* argv[], nebula_params *params, cli_options *cli){
+   static const struct option options[] = {
+      {"width",      required_argument, NULL, 'w'},
+      {"height",     required_argument, NULL, 'h'},
+      {"min-length", required_argument, NULL, 'm'},
+      {"max-length", required_argument, NULL, 'M'},
+      {"samples",    required_argument, NULL, 's'},
+      {"red",        required_argument, NULL, 'r'},
+      {"green",      required_argument, NULL, 'g'},
+      {"blue",       required_argument, NULL, 'b'},
+      {"exclusions", required_argument, NULL, 'x'},
+      {"sampler",    required_argument, NULL, 'S'},
+      {"target-error", required_argument, NULL, 'e'},
+      {"time-budget",  required_argument, NULL, 't'},
+      {"importance",   no_argument,       NULL, 'i'},
+      {"threads",      required_argument, NULL, 'j'},
+      {"output",       required_argument, NULL, 'o'},
+      {"benchmark-sampling", no_argument, NULL, 'B'},
+      {"serve",        required_argument, NULL, 'D'},
+      {"pyramid",      no_argument,       NULL, 'P'},
+      {"png",          no_argument,       NULL, 'N'},
+      {"png16",        no_argument,       NULL, 'H'},
+      {"delta-every",  required_argument, NULL, 'E'},
+      {"merge",        required_argument, NULL, 'A'},
+      {"placement",    required_argument, NULL, 'L'},
+      {"huge-pages",   required_argument, NULL, 'U'},
+      {"pin",          no_argument,       NULL, 'p'},
+      {"benchmark-scatter", no_argument,  NULL, 'C'},
+      {"survey",       no_argument,       NULL, 'V'},
+      {"survivors",    required_argument, NULL, 'K'},
+      {"resume",       required_argument, NULL, 'R'},
+      {"histogram",    required_argument, NULL, 'Y'},
+      {"no-cascade",   no_argument,       NULL, 'F'},
+      {"benchmark-cascade", no_argument,  NULL, 'Z'},
+      {NULL, 0, NULL, 0}
+   };
+   int option, channel;
+
+   while((option = getopt_long(argc, argv, "w:h:m:M:s:r:g:b:x:S:e:t:ij:o:", options, NULL)) != -1){
+      switch(option){
+         case 'w': params->width = atoi(optarg); break;
+         case 'h': params->height = atoi(optarg); break;
+         case 'm': params->min_orbital_length = atoi(optarg); break;
+         case 'M': params->max_orbital_length = atoi(optarg); break;
+         case 's': params->max_samples = atol(optarg); break;
+         case 'r':
+         case 'g':
+         case 'b':
+            channel = option == 'r' ? 0 : option == 'g' ? 1 : 2;
+            if(sscanf(optarg, "%d:%d", &params->channel_min[channel], &params->channel_max[channel]) != 2){
+               return FALSE;
+            }
+            break;
+         case 'x':
+            if(strcmp(optarg, "none") == 0){
+               params->exclusions = NEBULA_EXCLUDE_NONE;
+            } else if(strcmp(optarg, "cardioid") == 0){
+               params->exclusions = NEBULA_EXCLUDE_CARDIOID;
+            } else if(strcmp(optarg, "boxes") == 0){
+               params->exclusions = NEBULA_EXCLUDE_BOXES;
+            } else if(strcmp(optarg, "all") == 0){
+               params->exclusions = NEBULA_EXCLUDE_ALL;
+            } else {
+               return FALSE;
+            }
+            break;
+         case 'S':
+            if(strcmp(optarg, "uniform") == 0){
+               params->sampler = NEBULA_SAMPLER_UNIFORM;
+            } else if(strcmp(optarg, "halton") == 0){
+               params->sampler = NEBULA_SAMPLER_HALTON;
+            } else if(strcmp(optarg, "sobol") == 0){
+               params->sampler = NEBULA_SAMPLER_SOBOL;
+            } else if(strcmp(optarg, "stratified") == 0){
+               params->sampler = NEBULA_SAMPLER_STRATIFIED;
+            } else {
+               return FALSE;
+            }
+            break;
+         case 'e': params->target_error = atof(optarg); break;
+         case 't': params->time_budget = atof(optarg); break;
+         case 'i': params->importance = TRUE; break;
+         case 'j': params->threads = atoi(optarg); break;
+         case 'o': cli->output = optarg; break;
+         case 'B': cli->mode = MODE_BENCHMARK_SAMPLING; break;
+         case 'P': cli->format = FORMAT_PYRAMID; break;
+         case 'N': cli->format = FORMAT_PNG; break;
+         case 'H': cli->format = FORMAT_PNG16; break;
+         case 'E': cli->delta_interval = atof(optarg); break;
+         case 'L':
+            if(strcmp(optarg, "first-touch") == 0){
+               params->placement = NEBULA_PLACEMENT_FIRST_TOUCH;
+            } else if(strcmp(optarg, "interleave") == 0){
+               params->placement = NEBULA_PLACEMENT_INTERLEAVE;
+            } else if(strcmp(optarg, "replicate") == 0){
+               params->placement = NEBULA_PLACEMENT_REPLICATE;
+            } else {
+               return FALSE;
+            }
+            break;
+         case 'U':
+            if(strcmp(optarg, "none") == 0){
+               params->huge_pages = NEBULA_HUGE_PAGES_NONE;
+            } else if(strcmp(optarg, "transparent") == 0){
+               params->huge_pages = NEBULA_HUGE_PAGES_TRANSPARENT;
+            } else if(strcmp(optarg, "explicit") == 0){
+               params->huge_pages = NEBULA_HUGE_PAGES_EXPLICIT;
+            } else {
+               return FALSE;
+            }
+            break;
+         case 'p': params->pin_threads = TRUE; break;
+         case 'C': cli->mode = MODE_BENCHMARK_SCATTER; break;
+         case 'V': cli->mode = MODE_SURVEY; break;
+         case 'K': cli->survivors = optarg; break;
+         case 'R': cli->resume = optarg; break;
+         case 'Y': cli->histogram = optarg; break;
+         case 'F': params->cascade = FALSE; break;
+         case 'Z': cli->mode = MODE_BENCHMARK_CASCADE; break;
+         case 'A':
+            cli->mode = MODE_MERGE;
+            cli->aggregate = optarg;
+            break;
+         case 'D':
+            cli->mode = MODE_SERVE;
+            cli->socket_path = optarg;
+            break;
+         default:
+            return FALSE;
+      }
+   }
+   // Only a merge takes operands, the deltas
+   if(cli->mode == MODE_MERGE){
+      cli->deltas = argv + optind;
+      cli->delta_count = argc - optind;
+      return TRUE;
+   }
+   return optind == argc;
+}
+
+static void usage(const char *program, const nebula_params *defaults){
+   static const char *exclusions[] = {"none", "cardioid", "boxes", "all"};
+
+   printf("Usage: %s [options] [--merge HISTOGRAM DELTA...]\n", program);
+   printf("  -w, --width N            image width in pixels (%d)\n", defaults->width);
+   printf("  -h, --height N           image height in pixels (%d)\n", defaults->height);
+   printf("  -m, --min-length N       shortest orbit rendered, exclusive (%d)\n", defaults->min_orbital_length);
+   printf("  -M, --max-length N       longest orbit rendered, exclusive (%d)\n", defaults->max_orbital_length);
+   printf("  -s, --samples N          accepted orbits to trace, 0 for no limit (%ld)\n", defaults->max_samples);
+   printf("  -e, --target-error E     stop once every channel's estimated relative\n");
+   printf("                           error is below E\n");
+   printf("  -t, --time-budget S      stop after S seconds of sampling\n");
+   printf("  -r, --red MIN:MAX        orbit lengths counted in red (%d:%d)\n",
+      defaults->channel_min[0], defaults->channel_max[0]);
+   printf("  -g, --green MIN:MAX      orbit lengths counted in green (%d:%d)\n",
+      defaults->channel_min[1], defaults->channel_max[1]);
+   printf("  -b, --blue MIN:MAX       orbit lengths counted in blue (%d:%d)\n",
+      defaults->channel_min[2], defaults->channel_max[2]);
+   printf("  -x, --exclusions MODE    none, cardioid, boxes or all (%s)\n", exclusions[defaults->exclusions]);
+   printf("  -S, --sampler MODE       uniform, halton, sobol or stratified (%s)\n",
+      nebulaSamplerName(defaults->sampler));
+   printf("  -i, --importance         focus sampling on cells an escape-time prepass\n");
+   printf("                           finds productive, weighting hits to stay unbiased\n");
+   printf("      --no-cascade         search every draw in long double, without the\n");
+   printf("                           double precision first pass\n");
+   printf("  -j, --threads N          worker threads, 0 for one per core\n");
+   printf("      --placement MODE     first-touch, interleave or replicate, where the\n");
+   printf("                           histogram's pages live across NUMA nodes\n");
+   printf("      --huge-pages MODE    none, transparent or explicit (none)\n");
+   printf("      --pin                pin workers to CPUs spread over the nodes\n");
+   printf("  -o, --output FILE        image file name (named after the time), a .png\n");
+   printf("                           name writes a PNG\n");
+   printf("      --png, --png16       write an 8 or 16 bit per channel PNG\n");
+   printf("      --pyramid            write a deep zoom tile pyramid, FILE.dzi and\n");
+   printf("                           FILE_files/, instead of one image\n");
+   printf("      --survey             estimate the job's acceptance rate, orbit lengths\n");
+   printf("                           and run time from a quick stratified sample\n");
+   printf("      --benchmark-sampling compare each sampler's noise at --samples against\n");
+   printf("                           a reference render of %d times as many\n", BENCHMARK_REFERENCE_FACTOR);
+   printf("      --benchmark-scatter  time the job with each placement and page size\n");
+   printf("      --benchmark-cascade  time the search with and without the cascade and\n");
+   printf("                           compare the images they trace\n");
+   printf("      --serve SOCKET       keep histograms resident and refining, serving\n");
+   printf("                           views of them on a Unix socket (see daemon.h)\n");
+   printf("      --delta-every S      also write what the histogram gained every S\n");
+   printf("                           seconds to FILE.0001.delta, FILE.0002.delta...\n");
+   printf("      --merge HISTOGRAM    add the delta files given after the options to a\n");
+   printf("                           histogram file and write its image\n");
+   printf("      --histogram FILE     add the render to a histogram file, created if\n");
+   printf("                           missing, and write the image of the total\n");
+   printf("      --survivors FILE     keep the orbits that outlast the window, with\n");
+   printf("                           where they stopped, for a deeper --resume\n");
+   printf("      --resume FILE        carry on a survivors table to this cap instead of\n");
+   printf("                           drawing, tracing only the orbits now in the window\n");
+}
+
+// Renders one job into a BMP or PNG, or a tile pyramid named after it, with
+// its metadata next to it. With a histogram file the image is of the file
+// once the render is added to it.
+static int render(const nebula_params *params, const cli_options *cli){
+   long long *histogram = nebulaAllocHistogram(params), *total = NULL, total_samples;
+   const char *filename = cli->output;
+   nebula_context *context = NULL;
+   nebula_stats stats;
+   delta_exporter exporter;
+   char basename[256], image[272], metaname[272];
+   int rendered = FALSE, sampled, width, height;
+
+   snprintf(basename, sizeof(basename), "%.*s",
+      strrchr(filename, '.') ? (int)(strrchr(filename, '.') - filename) : (int)strlen(filename), filename);
+   snprintf(image, sizeof(image), cli->format == FORMAT_PYRAMID ? "%s.dzi" : "%s",
+      cli->format == FORMAT_PYRAMID ? basename : filename);
+   snprintf(metaname, sizeof(metaname), "%s.txt", basename);
+
+   memset(&exporter, 0, sizeof(exporter));
+   if(histogram == NULL || (context = nebulaCreate(params, histogram)) == NULL
+         || (cli->delta_interval > 0
+            && (exporter.delta = nebulaDeltaCreate(histogram, params->width, params->height,
+               nebulaHitWeight(params))) == NULL)){
+      printf("Could not allocate a %dx%d image\n", params->width, params->height);
+   } else if(cli->resume != NULL && cli->survivors != NULL && strcmp(cli->resume, cli->survivors) == 0){
+      printf("Survivors must be kept in another file than %s\n", cli->resume);
+   } else if(cli->resume != NULL && nebulaResumeSurvivors(context, cli->resume) == FALSE){
+      printf("Could not read survivors table %s\n", cli->resume);
+   } else if(cli->survivors != NULL && nebulaKeepSurvivors(context, cli->survivors) == FALSE){
+      printf("Could not create %s\n", cli->survivors);
+   } else {
+      nebulaStats(context, &stats);
+      printf("Using %s kernel\n", stats.kernel);
+      if(cli->resume != NULL){
+         printf("Resuming Survivors Of %s\n", cli->resume);
+      }
+      printf("Processing Points\n");
+      if(exporter.delta != NULL){
+         exporter.context = context;
+         exporter.basename = basename;
+         exporter.interval = cli->delta_interval;
+         pthread_mutex_init(&exporter.lock, NULL);
+         pthread_cond_init(&exporter.wake, NULL);
+         // Without the thread only the final delta is written
+         exporter.started = pthread_create(&exporter.thread, NULL, deltaExporter, &exporter) == 0;
+         if(exporter.started == FALSE){
+            printf("Could not start the delta exporter, writing one delta at the end\n");
+         }
+      }
+      sampled = nebulaSample(context);
+      if(exporter.delta != NULL){
+         pthread_mutex_lock(&exporter.lock);
+         exporter.done = TRUE;
+         pthread_cond_signal(&exporter.wake);
+         pthread_mutex_unlock(&exporter.lock);
+         if(exporter.started){
+            pthread_join(exporter.thread, NULL);
+         }
+         pthread_mutex_destroy(&exporter.lock);
+         pthread_cond_destroy(&exporter.wake);
+         sampled = exportDelta(&exporter) && sampled;
+      }
+      if(sampled == FALSE){
+         printf("Could not build the importance map, export a delta or keep survivors\n");
+      } else {
+         nebulaStats(context, &stats);
+         if(cli->survivors != NULL){
+            printf("Kept %lld survivors in %s\n", stats.survivors, cli->survivors);
+         }
+         if(cli->histogram != NULL){
+            if(nebulaAddHistogram(cli->histogram, histogram, params->width, params->height,
+                  stats.samples, stats.hit_weight)){
+               total = nebulaLoadHistogram(cli->histogram, &width, &height, &total_samples);
+            }
+            if(total == NULL){
+               printf("Could not add the render to %s, or it holds another size or hit weight\n",
+                  cli->histogram);
+            } else {
+               printf("%s holds %lld samples\n", cli->histogram, total_samples);
+            }
+         }
+         if(cli->histogram == NULL || total != NULL){
+            rendered = writeImage(total ? total : histogram, params->width, params->height, filename,
+               basename, cli->format, params->threads);
+            rendered = rendered && nebulaWriteMetadata(metaname, image, params, &stats);
+            if(rendered == FALSE){
+               printf("Could not write %s\n", image);
+            }
+         }
+      }
+   }
+   nebulaDeltaDestroy(exporter.delta);
+   nebulaDestroy(context);
+   free(total);
+   if(histogram != NULL){
+      nebulaFreeHistogram(histogram, params);
+   }
+   return rendered;
+}
+
+static int writeImage(const long long *histogram, int width, int height, const char *filename,
+      const char *basename, int format, int threads){
+   unsigned char *pixels;
+   int written;
+
+   if(format == FORMAT_PYRAMID){
+      printf("Writing Tile Pyramid\n");
+      return nebulaWritePyramid(basename, histogram, width, height, PYRAMID_TILE, threads);
+   }
+   if(format != FORMAT_BMP){
+      printf("Rendering And Saving PNG\n");
+      return nebulaWritePng(filename, histogram, width, height, format == FORMAT_PNG16 ? 16 : 8, threads);
+   }
+   pixels = malloc((size_t)width * height * NEBULA_RGB);
+   if(pixels == NULL){
+      return FALSE;
+   }
+   printf("Rendering Image\n");
+   nebulaToneMap(histogram, width, height, pixels);
+   printf("Saving To File\n");
+   written = nebulaWriteBmp(filename, width, height, pixels);
+   free(pixels);
+   return written;
+}
+
+static void *deltaExporter(void *arg){
+   delta_exporter *exporter = arg;
+   struct timespec deadline;
+   double seconds;
+
+   pthread_mutex_lock(&exporter->lock);
+   while(exporter->done == FALSE){
+      clock_gettime(CLOCK_REALTIME, &deadline);
+      seconds = deadline.tv_sec + deadline.tv_nsec * 1e-9 + exporter->interval;
+      deadline.tv_sec = seconds;
+      deadline.tv_nsec = (seconds - deadline.tv_sec) * 1e9;
+      while(exporter->done == FALSE
+            && pthread_cond_timedwait(&exporter->wake, &exporter->lock, &deadline) == 0);
+      if(exporter->done == FALSE){
+         pthread_mutex_unlock(&exporter->lock);
+         exportDelta(exporter);
+         pthread_mutex_lock(&exporter->lock);
+      }
+   }
+   pthread_mutex_unlock(&exporter->lock);
+   return NULL;
+}
+
+static int exportDelta(delta_exporter *exporter){
+   long samples = nebulaSamples(exporter->context);
+   char name[288];
+   long size;
+
+   snprintf(name, sizeof(name), "%s.%04d.delta", exporter->basename, ++exporter->exports);
+   size = nebulaExportDelta(exporter->delta, name, samples - exporter->last_samples);
+   if(size < 0){
+      printf("Could not write %s\n", name);
+      return FALSE;
+   }
+   printf("Wrote %s, %ld samples in %ld bytes\n", name, samples - exporter->last_samples, size);
+   exporter->last_samples = samples;
+   return TRUE;
+}
+
+// Adds each delta to the aggregate histogram file in turn, then writes the
+// image of the aggregate
+static int mergeDeltas(const nebula_params *params, const cli_options *cli){
+   const char *filename = cli->output;
+   char basename[256];
+   long long *histogram, samples;
+   int width, height, i, written;
+
+   for(i = 0; i < cli->delta_count; i++){
+      if(nebulaApplyDelta(cli->aggregate, cli->deltas[i]) == FALSE){
+         printf("Could not add %s to %s, or it holds another size or hit weight\n",
+            cli->deltas[i], cli->aggregate);
+         return FALSE;
+      }
+      printf("Added %s\n", cli->deltas[i]);
+   }
+   histogram = nebulaLoadHistogram(cli->aggregate, &width, &height, &samples);
+   if(histogram == NULL){
+      printf("Could not read %s\n", cli->aggregate);
+      return FALSE;
+   }
+   printf("%s holds %lld samples at %dx%d\n", cli->aggregate, samples, width, height);
+
+   snprintf(basename, sizeof(basename), "%.*s",
+      strrchr(filename, '.') ? (int)(strrchr(filename, '.') - filename) : (int)strlen(filename), filename);
+   written = writeImage(histogram, width, height, filename, basename, cli->format, params->threads);
+   if(written == FALSE){
+      printf("Could not write %s\n", filename);
+   }
+   free(histogram);
+   return written;
+}
+
+// Prints what a quick survey predicts for the job: where orbits escape,
+// how many draws each window keeps and how long max_samples would take
+static int surveyJob(const nebula_params *params){
+   static const char *channels[] = {"red", "green", "blue"};
+   nebula_survey survey;
+   long long escaped = 0;
+   int bucket, channel;
+
+   printf("Surveying %d stratified points\n", SURVEY_PROBES);
+   if(nebulaSurvey(params, SURVEY_PROBES, &survey) == FALSE){
+      printf("Could not survey the job\n");
+      return FALSE;
+   }
+   for(bucket = 0; bucket < NEBULA_SURVEY_BUCKETS; bucket++){
+      escaped += survey.lengths[bucket];
+   }
+
+   printf("\n%-22s %10s %9s\n", "orbit length", "points", "share");
+   printf("%-22s %10ld %8.3f%%\n", "excluded", survey.excluded, 100.0 * survey.excluded / survey.probes);
+   for(bucket = 0; bucket < NEBULA_SURVEY_BUCKETS; bucket++){
+      if(survey.lengths[bucket] > 0){
+         char range[32];
+         snprintf(range, sizeof(range), "%lld-%lld", 1LL << bucket, (2LL << bucket) - 1);
+         printf("%-22s %10lld %8.3f%%\n", range, survey.lengths[bucket], 100.0 * survey.lengths[bucket] / survey.probes);
+      }
+   }
+   printf("%-22s %10ld %8.3f%%\n", "bounded", survey.bounded, 100.0 * survey.bounded / survey.probes);
+
+   printf("\n");
+   if(survey.accepted > 0){
+      printf("Orbital window %d-%d accepts %.4f%% of draws (+/- %.4f%%), 1 in %.0f\n",
+         params->min_orbital_length, params->max_orbital_length,
+         100 * survey.acceptance, 100 * survey.acceptance_error, 1 / survey.acceptance);
+   } else {
+      printf("Orbital window %d-%d accepted none of %ld points, fewer than 1 in %.0f draws\n",
+         params->min_orbital_length, params->max_orbital_length, survey.probes, 1 / survey.acceptance_error);
+   }
+   for(channel = 0; channel < NEBULA_CHANNELS; channel++){
+      printf("  %-5s %d-%d counts %.4f%% of draws\n", channels[channel], params->channel_min[channel],
+         params->channel_max[channel], 100 * survey.channel_acceptance[channel]);
+   }
+   printf("Splats per accepted orbit %.1f, histogram adds %.1f\n",
+      survey.splats_per_orbit, survey.adds_per_orbit);
+   printf("Search %.3g s per draw, trace %.3g s per orbit, on one core\n",
+      survey.probe_seconds, survey.orbit_seconds);
+   if(survey.projected_seconds >= 0){
+      printf("Projected %.0f s for %ld samples on %d threads\n",
+         survey.projected_seconds, params->max_samples, survey.threads);
+   } else if(params->max_samples > 0){
+      printf("No projection for %ld samples without accepted orbits\n", params->max_samples);
+   }
+   printf("Survey took %.2f s\n", survey.seconds);
+   return TRUE;
+}
+
+// Renders a reference from BENCHMARK_REFERENCE_FACTOR times the sample count,
+// then the same job with every sampler, and reports how far each is from
+// the reference. Monte Carlo noise falls as 1/sqrt(samples), so an error
+// ratio r means uniform sampling needs r^2 as many samples to match. Every
+// render runs to its sample count, so budgets and targets are ignored.
+static int benchmarkSampling(const nebula_params *params){
+   size_t cells = nebulaHistogramLength(params);
+   nebula_params job = *params;
+   long samples = params->max_samples;
+   unsigned long long seed = params->seed ? params->seed : (unsigned long long)time(NULL) << 20;
+   long long *reference = malloc(cells * sizeof(long long));
+   long long *histogram = malloc(cells * sizeof(long long));
+   nebula_context *context;
+   nebula_stats stats;
+   double error[4], seconds[4], uniform_error;
+   int sampler, trial;
+
+   if(samples == 0){
+      printf("The sampling benchmark needs a sample count, --samples N\n");
+      free(reference);
+      free(histogram);
+      return FALSE;
+   }
+   if(reference == NULL || histogram == NULL){
+      printf("Could not allocate the reference image\n");
+      free(reference);
+      free(histogram);
+      return FALSE;
+   }
+
+   job.target_error = 0;
+   job.time_budget = 0;
+   printf("Rendering reference from %ld samples\n", samples * BENCHMARK_REFERENCE_FACTOR);
+   job.sampler = NEBULA_SAMPLER_UNIFORM;
+   job.max_samples = samples * BENCHMARK_REFERENCE_FACTOR;
+   memset(reference, 0, cells * sizeof(long long));
+   context = nebulaCreate(&job, reference);
+   if(context == NULL || nebulaSample(context) == FALSE){
+      printf("Could not render the reference\n");
+      nebulaDestroy(context);
+      free(reference);
+      free(histogram);
+      return FALSE;
+   }
+   nebulaDestroy(context);
+
+   // A context carries its sequences on from run to run, so every trial
+   // gets a context and scramble of its own
+   job.max_samples = samples;
+   for(sampler = NEBULA_SAMPLER_UNIFORM; sampler <= NEBULA_SAMPLER_STRATIFIED; sampler++){
+      job.sampler = sampler;
+      error[sampler] = 0;
+      seconds[sampler] = 0;
+      for(trial = 0; trial < BENCHMARK_TRIALS; trial++){
+         printf("Benchmarking %s sampler, trial %d\n", nebulaSamplerName(sampler), trial + 1);
+         job.seed = (seed + trial * 0x9E3779B97F4A7C15ULL) | 1;
+         memset(histogram, 0, cells * sizeof(long long));
+         context = nebulaCreate(&job, histogram);
+         if(context == NULL || nebulaSample(context) == FALSE){
+            printf("Could not render with the %s sampler\n", nebulaSamplerName(sampler));
+            nebulaDestroy(context);
+            free(reference);
+            free(histogram);
+            return FALSE;
+         }
+         nebulaStats(context, &stats);
+         nebulaDestroy(context);
+         seconds[sampler] += stats.seconds;
+         error[sampler] += pow(histogramError(params, histogram, reference), 2);
+      }
+      error[sampler] = sqrt(error[sampler] / BENCHMARK_TRIALS);
+      seconds[sampler] /= BENCHMARK_TRIALS;
+   }
+
+   uniform_error = error[NEBULA_SAMPLER_UNIFORM];
+   printf("\n%-11s %12s %10s %22s %9s\n", "sampler", "rel. error", "seconds",
+      "uniform samples equal", "saved");
+   for(sampler = NEBULA_SAMPLER_UNIFORM; sampler <= NEBULA_SAMPLER_STRATIFIED; sampler++){
+      double ratio = pow(uniform_error / error[sampler], 2);
+      printf("%-11s %12.5f %10.2f %22.0f %8.1f%%\n", nebulaSamplerName(sampler), error[sampler],
+         seconds[sampler], samples * ratio, 100 * (1 - 1 / ratio));
+   }
+   free(reference);
+   free(histogram);
+   return TRUE;
+}
+
+// Renders the job once with every histogram placement and page size, the
+// same seed each time, and reports how fast the splat stage added hits.
+// Replicas always pin their workers, the other placements are timed both
+// free and pinned.
+static int benchmarkScatter(const nebula_params *params){
+   static const char *placements[] = {"first-touch", "interleave", "replicate"};
+   static const char *huge_pages[] = {"none", "transparent", "explicit"};
+   nebula_params job = *params;
+   size_t cells = nebulaHistogramLength(params), i;
+   long long *histogram, hits;
+   nebula_context *context;
+   nebula_stats stats;
+   int placement, pages, pin;
+
+   job.verbose = FALSE;
+   job.seed = params->seed ? params->seed : 1;
+   printf("%-12s %-12s %-4s %10s %12s %14s\n", "placement", "huge pages", "pin",
+      "seconds", "samples/s", "M hits/s");
+   for(placement = NEBULA_PLACEMENT_FIRST_TOUCH; placement <= NEBULA_PLACEMENT_REPLICATE; placement++){
+      for(pin = placement == NEBULA_PLACEMENT_REPLICATE; pin <= 1; pin++){
+         for(pages = NEBULA_HUGE_PAGES_NONE; pages <= NEBULA_HUGE_PAGES_EXPLICIT; pages++){
+            job.placement = placement;
+            job.huge_pages = pages;
+            job.pin_threads = pin;
+            histogram = nebulaAllocHistogram(&job);
+            context = histogram ? nebulaCreate(&job, histogram) : NULL;
+            if(context == NULL || nebulaSample(context) == FALSE){
+               printf("%-12s %-12s %-4s %10s\n", placements[placement], huge_pages[pages],
+                  pin ? "yes" : "no", "unavailable");
+            } else {
+               nebulaStats(context, &stats);
+               for(hits = 0, i = 0; i < cells; i++){
+                  hits += histogram[i];
+               }
+               hits /= stats.hit_weight;
+               printf("%-12s %-12s %-4s %10.2f %12.0f %14.2f\n", placements[placement], huge_pages[pages],
+                  pin ? "yes" : "no", stats.seconds, stats.samples / stats.seconds, hits / stats.seconds / 1e6);
+            }
+            nebulaDestroy(context);
+            if(histogram != NULL){
+               nebulaFreeHistogram(histogram, &job);
+            }
+         }
+      }
+   }
+   return TRUE;
+}
+
+// Compares the search with and without the cascade on the same draws, then
+// renders the job both ways with the same seed and reports the throughput
+static int benchmarkCascade(const nebula_params *params){
+   static const char *modes[] = {"long double", "cascade"};
+   nebula_params job = *params;
+   nebula_cascade_check check;
+   long long *histogram;
+   nebula_context *context;
+   nebula_stats stats;
+   int cascade;
+
+   printf("Searching %d draws with and without the cascade\n", CASCADE_DRAWS);
+   if(nebulaCheckCascade(params, CASCADE_DRAWS, &check) == FALSE){
+      printf("Could not check the cascade\n");
+      return FALSE;
+   }
+   printf("\n%-12s %12s %12s %14s\n", "search", "accepted", "ns/draw", "M draws/s");
+   printf("%-12s %12ld %12.1f %14.2f\n", modes[0], check.reference_accepted,
+      1e9 * check.reference_seconds / check.draws, check.draws / check.reference_seconds / 1e6);
+   printf("%-12s %12ld %12.1f %14.2f\n", modes[1], check.accepted,
+      1e9 * check.cascade_seconds / check.draws, check.draws / check.cascade_seconds / 1e6);
+   printf("Promoted to long double %.3f%% of draws, speedup %.2fx on one core\n",
+      100.0 * check.promoted / check.draws, check.reference_seconds / check.cascade_seconds);
+   printf("Missed %ld accepted orbits, %.4f%% of pixels identical, hits differ by %.2g\n",
+      check.missed, 100 * check.pixel_agreement, check.hit_difference);
+
+   job.verbose = FALSE;
+   job.seed = params->seed ? params->seed : 1;
+   printf("\n%-12s %10s %12s\n", "render", "seconds", "samples/s");
+   for(cascade = FALSE; cascade <= TRUE; cascade++){
+      job.cascade = cascade;
+      histogram = nebulaAllocHistogram(&job);
+      context = histogram ? nebulaCreate(&job, histogram) : NULL;
+      if(context == NULL || nebulaSample(context) == FALSE){
+         printf("%-12s %10s\n", modes[cascade], "unavailable");
+      } else {
+         nebulaStats(context, &stats);
+         printf("%-12s %10.2f %12.0f\n", modes[cascade], stats.seconds, stats.samples / stats.seconds);
+      }
+      nebulaDestroy(context);
+      if(histogram != NULL){
+         nebulaFreeHistogram(histogram, &job);
+      }
+   }
+   return TRUE;
+}
+
+// RMS difference of the per-channel normalized histograms, relative to the
+// RMS of the reference and averaged over the channels that have any hits
+static double histogramError(const nebula_params *params, const long long *estimate, const long long *reference){
+   size_t pixel, pixels = (size_t)params->width * params->height;
+   double estimate_total, reference_total, difference, norm, error = 0;
+   int channel, counted = 0;
+
+   for(channel = 0; channel < NEBULA_CHANNELS; channel++){
+      estimate_total = 0;
+      reference_total = 0;
+      for(pixel = 0; pixel < pixels; pixel++){
+         estimate_total += estimate[pixel * NEBULA_CHANNELS + channel];
+         reference_total += reference[pixel * NEBULA_CHANNELS + channel];
+      }
+      if(estimate_total == 0 || reference_total == 0){
+         continue;
+      }
+      difference = 0;
+      norm = 0;
+      for(pixel = 0; pixel < pixels; pixel++){
+         double expected = reference[pixel * NEBULA_CHANNELS + channel] / reference_total;
+         double measured = estimate[pixel * NEBULA_CHANNELS + channel] / estimate_total;
+         difference += (measured - expected) * (measured - expected);
+         norm += expected * expected;
+      }
+      error += sqrt(difference / norm);
+      counted++;
+   }
+   return counted ? error / counted : 0;
+}
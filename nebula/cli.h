@@ -0,0 +1,17 @@
+/*************************************************/
+/*           NebulaBrot Command Line             */
+/*************************************************/
+
+// Shared command line front end of the renderer programs
+
+#ifndef NEBULA_CLI_H
+#define NEBULA_CLI_H
+
+#include "nebula.h"
+
+// Parses the options over the program's defaults, renders and writes the
+// image and its metadata. A NULL output names the image after the time.
+// Returns the process exit status.
+int nebulaMain(int argc, char* argv[], const nebula_params *defaults, const char *output);
+
+#endif
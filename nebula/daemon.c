@@ -0,0 +1,658 @@
+/*************************************************/
+/*            NebulaBrot Render Daemon           */
+/*************************************************/
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <signal.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/un.h>
+
+#include "daemon.h"
+
+#define TRUE 1
+#define FALSE 0
+
+/*************************************************/
+/*                Daemon Variables               */
+/*************************************************/
+
+// Resident histograms, and the memory they may take between them counting
+// everything a job holds at its peak, see residentMemory()
+#define DAEMON_HISTOGRAMS 16
+#define DAEMON_MEMORY_MB 4096
+
+// Clients served at once, any more are turned away with "error busy".
+// Clients that stop sending or stop reading are dropped so they can't hold
+// a slot.
+#define DAEMON_CLIENTS 8
+#define DAEMON_IDLE_SECONDS 30
+
+// Histograms are refined in turn, each for a slice of this many seconds,
+// and a histogram refined alone runs on until another is opened. The one
+// being refined is republished every DAEMON_PUBLISH_SECONDS while its
+// workers run, and once more when its run ends.
+#define DAEMON_SLICE_SECONDS 1.0
+#define DAEMON_PUBLISH_SECONDS 1.0
+
+#define DAEMON_NAME 64
+#define DAEMON_LINE 1024
+
+// Immutable copy of a histogram, shared by the requests reading it
+typedef struct _snapshot {
+   int references;
+   long samples;
+   long long channel_max[NEBULA_CHANNELS];
+   long long *histogram;
+} snapshot;
+
+typedef struct _resident {
+   int open;
+   int closing;                  // Closed while being refined, freed after the slice
+   int refining;
+   int alone;                    // Refined without a slice limit, stopped when another opens
+   int publishing;               // A snapshot is being copied from the live histogram
+   char name[DAEMON_NAME];
+   nebula_params params;
+   long sample_cap;              // 0 for no limit
+   long samples;
+   long long *histogram;
+   nebula_context *context;
+   snapshot *published;
+   snapshot *spare;              // A retired snapshot no request holds, refilled by the next copy
+} resident;
+
+typedef struct _daemon_state {
+   pthread_mutex_t lock;
+   pthread_cond_t work;
+   pthread_cond_t copied;
+   resident histograms[DAEMON_HISTOGRAMS];
+   int next;
+   int clients;
+   size_t memory;
+   nebula_params defaults;
+} daemon_state;
+
+typedef struct _client {
+   daemon_state *daemon;
+   int fd;
+} client;
+
+static void *refineWorker(void *arg);
+static void *publishWorker(void *arg);
+static resident *nextResident(daemon_state *daemon, const resident *skip);
+static snapshot *takeSnapshot(resident *job, snapshot *shot);
+static void publishSnapshot(resident *job, snapshot *fresh);
+static void releaseSnapshot(snapshot *shot);
+static void releaseResident(daemon_state *daemon, resident *job);
+static resident *findResident(daemon_state *daemon, const char *name);
+static size_t residentMemory(const nebula_params *params);
+static void *clientWorker(void *arg);
+static void handleRequest(daemon_state *daemon, char *line, FILE *out);
+static void openRequest(daemon_state *daemon, const char *name, char **save, FILE *out);
+static void imageRequest(daemon_state *daemon, const char *name, char **save, FILE *out);
+static void statsRequest(daemon_state *daemon, const char *name, FILE *out);
+static void listRequest(daemon_state *daemon, FILE *out);
+static void closeRequest(daemon_state *daemon, const char *name, FILE *out);
+static int parseJob(char **save, nebula_params *params, long *sample_cap);
+
+
+int nebulaServe(const char *path, const nebula_params *defaults){
+   daemon_state *daemon = calloc(1, sizeof(daemon_state));
+   struct sockaddr_un address;
+   pthread_t refiner, publisher, thread;
+   client *connection;
+   int listener, fd;
+
+   if(daemon == NULL || strlen(path) >= sizeof(address.sun_path)){
+      printf("Could not serve on %s\n", path);
+      free(daemon);
+      return EXIT_FAILURE;
+   }
+   pthread_mutex_init(&daemon->lock, NULL);
+   pthread_cond_init(&daemon->work, NULL);
+   pthread_cond_init(&daemon->copied, NULL);
+   daemon->defaults = *defaults;
+   daemon->defaults.verbose = FALSE;
+
+   memset(&address, 0, sizeof(address));
+   address.sun_family = AF_UNIX;
+   strcpy(address.sun_path, path);
+   unlink(path);
+   listener = socket(AF_UNIX, SOCK_STREAM, 0);
+   if(listener < 0 || bind(listener, (struct sockaddr *)&address, sizeof(address)) < 0
+         || listen(listener, DAEMON_CLIENTS) < 0){
+      printf("Could not listen on %s\n", path);
+      free(daemon);
+      return EXIT_FAILURE;
+   }
+   signal(SIGPIPE, SIG_IGN);
+   if(pthread_create(&refiner, NULL, refineWorker, daemon) != 0
+         || pthread_create(&publisher, NULL, publishWorker, daemon) != 0){
+      printf("Could not start refining\n");
+      close(listener);
+      free(daemon);
+      return EXIT_FAILURE;
+   }
+   printf("Serving on %s\n", path);
+   fflush(stdout);
+
+   while(TRUE){
+      fd = accept(listener, NULL, NULL);
+      if(fd < 0){
+         continue;
+      }
+      pthread_mutex_lock(&daemon->lock);
+      connection = daemon->clients < DAEMON_CLIENTS ? malloc(sizeof(client)) : NULL;
+      if(connection != NULL){
+         daemon->clients++;
+      }
+      pthread_mutex_unlock(&daemon->lock);
+      if(connection == NULL){
+         dprintf(fd, "error busy\n");
+         close(fd);
+         continue;
+      }
+      connection->daemon = daemon;
+      connection->fd = fd;
+      if(pthread_create(&thread, NULL, clientWorker, connection) != 0){
+         pthread_mutex_lock(&daemon->lock);
+         daemon->clients--;
+         pthread_mutex_unlock(&daemon->lock);
+         free(connection);
+         dprintf(fd, "error busy\n");
+         close(fd);
+         continue;
+      }
+      pthread_detach(thread);
+   }
+}
+
+// Refines the resident histograms in turn, one slice each, publishing a
+// fresh snapshot after every run
+static void *refineWorker(void *arg){
+   daemon_state *daemon = arg;
+   resident *job;
+   snapshot *fresh, *spare;
+   long remaining;
+   int closing;
+
+   while(TRUE){
+      pthread_mutex_lock(&daemon->lock);
+      while((job = nextResident(daemon, NULL)) == NULL){
+         pthread_cond_wait(&daemon->work, &daemon->lock);
+      }
+      job->refining = TRUE;
+      job->alone = nextResident(daemon, job) == NULL;
+      remaining = job->sample_cap > 0 ? job->sample_cap - job->samples : 0;
+      closing = job->closing;
+      pthread_mutex_unlock(&daemon->lock);
+
+      // A close or an open from here on stops the run through nebulaStop(),
+      // which holds for a run that hasn't started yet
+      nebulaSetLimits(job->context, remaining, job->alone ? 0 : DAEMON_SLICE_SECONDS);
+      if(closing == FALSE){
+         nebulaSample(job->context);
+      }
+
+      // The run is over, so this copy is exact. The publisher is waited for,
+      // so it never counts the next run's orbits against this one's.
+      pthread_mutex_lock(&daemon->lock);
+      while(job->publishing){
+         pthread_cond_wait(&daemon->copied, &daemon->lock);
+      }
+      closing = job->closing;
+      job->publishing = !closing;
+      spare = job->spare;
+      job->spare = NULL;
+      pthread_mutex_unlock(&daemon->lock);
+      fresh = closing ? spare : takeSnapshot(job, spare);
+
+      pthread_mutex_lock(&daemon->lock);
+      job->refining = FALSE;
+      job->publishing = FALSE;
+      job->samples += nebulaSamples(job->context);
+      if(job->closing){
+         releaseSnapshot(fresh);
+         releaseResident(daemon, job);
+      } else if(fresh != NULL){
+         fresh->samples = job->samples;
+         publishSnapshot(job, fresh);
+      }
+      pthread_mutex_unlock(&daemon->lock);
+   }
+   return NULL;
+}
+
+// Republishes the histogram being refined every DAEMON_PUBLISH_SECONDS,
+// copied while its workers keep adding to it
+static void *publishWorker(void *arg){
+   daemon_state *daemon = arg;
+   resident *job = NULL;
+   snapshot *fresh, *spare;
+   long samples;
+   int i;
+
+   while(TRUE){
+      usleep(DAEMON_PUBLISH_SECONDS * 1000000);
+      pthread_mutex_lock(&daemon->lock);
+      for(job = NULL, i = 0; i < DAEMON_HISTOGRAMS && job == NULL; i++){
+         if(daemon->histograms[i].refining && !daemon->histograms[i].closing
+               && !daemon->histograms[i].publishing){
+            job = &daemon->histograms[i];
+         }
+      }
+      if(job == NULL){
+         pthread_mutex_unlock(&daemon->lock);
+         continue;
+      }
+      job->publishing = TRUE;
+      samples = job->samples;
+      spare = job->spare;
+      job->spare = NULL;
+      pthread_mutex_unlock(&daemon->lock);
+
+      fresh = takeSnapshot(job, spare);
+
+      // The refiner's exact copy at the end of a run may have been
+      // published meanwhile, an older copy doesn't replace it
+      pthread_mutex_lock(&daemon->lock);
+      job->publishing = FALSE;
+      if(fresh != NULL){
+         fresh->samples += samples;
+         if(job->published == NULL || fresh->samples > job->published->samples){
+            publishSnapshot(job, fresh);
+         } else {
+            releaseSnapshot(fresh);
+         }
+      }
+      pthread_cond_broadcast(&daemon->copied);
+      pthread_mutex_unlock(&daemon->lock);
+   }
+   return NULL;
+}
+
+// Next histogram still short of its sample cap, round robin, other than
+// skip. Only advances the turn without skip. Called locked.
+static resident *nextResident(daemon_state *daemon, const resident *skip){
+   resident *job;
+   int i;
+
+   for(i = 0; i < DAEMON_HISTOGRAMS; i++){
+      job = &daemon->histograms[(daemon->next + i) % DAEMON_HISTOGRAMS];
+      if(job != skip && job->open && !job->closing
+            && (job->sample_cap == 0 || job->samples < job->sample_cap)){
+         if(skip == NULL){
+            daemon->next = (daemon->next + i + 1) % DAEMON_HISTOGRAMS;
+         }
+         return job;
+      }
+   }
+   return NULL;
+}
+
+// Copies the live histogram into shot, or a new snapshot if it is NULL.
+// The snapshot's samples are those of the run going on.
+static snapshot *takeSnapshot(resident *job, snapshot *shot){
+   size_t length = nebulaHistogramLength(&job->params);
+
+   if(shot == NULL){
+      shot = malloc(sizeof(snapshot));
+      if(shot == NULL || (shot->histogram = malloc(length * sizeof(long long))) == NULL){
+         free(shot);
+         return NULL;
+      }
+   }
+   shot->samples = nebulaCopyHistogram(job->context, shot->histogram);
+   nebulaHistogramMax(shot->histogram, job->params.width, job->params.height, shot->channel_max);
+   shot->references = 1;
+   return shot;
+}
+
+// Replaces the published snapshot. The one it replaces is kept to be
+// refilled if no request holds it. Called locked.
+static void publishSnapshot(resident *job, snapshot *fresh){
+   snapshot *retired = job->published;
+
+   job->published = fresh;
+   if(retired != NULL && retired->references == 1 && job->spare == NULL){
+      job->spare = retired;
+   } else {
+      releaseSnapshot(retired);
+   }
+}
+
+// Drops a reference to a snapshot. Called locked.
+static void releaseSnapshot(snapshot *shot){
+   if(shot != NULL && --shot->references == 0){
+      free(shot->histogram);
+      free(shot);
+   }
+}
+
+// Frees a histogram that isn't being refined. Called locked.
+static void releaseResident(daemon_state *daemon, resident *job){
+   nebulaDestroy(job->context);
+   if(job->histogram != NULL){
+      nebulaFreeHistogram(job->histogram, &job->params);
+   }
+   releaseSnapshot(job->published);
+   releaseSnapshot(job->spare);
+   daemon->memory -= residentMemory(&job->params);
+   memset(job, 0, sizeof(resident));
+}
+
+// Called locked
+static resident *findResident(daemon_state *daemon, const char *name){
+   int i;
+   for(i = 0; i < DAEMON_HISTOGRAMS; i++){
+      if(daemon->histograms[i].open && !daemon->histograms[i].closing
+            && strcmp(daemon->histograms[i].name, name) == 0){
+         return &daemon->histograms[i];
+      }
+   }
+   return NULL;
+}
+
+// At its peak a job holds the histogram, the published snapshot and the
+// one replacing it or kept spare, besides its context
+static size_t residentMemory(const nebula_params *params){
+   return 3 * nebulaHistogramLength(params) * sizeof(long long) + nebulaContextMemory(params);
+}
+
+static void *clientWorker(void *arg){
+   client *self = arg;
+   daemon_state *daemon = self->daemon;
+   struct timeval idle = {DAEMON_IDLE_SECONDS, 0};
+   char line[DAEMON_LINE];
+   FILE *in, *out;
+
+   setsockopt(self->fd, SOL_SOCKET, SO_RCVTIMEO, &idle, sizeof(idle));
+   setsockopt(self->fd, SOL_SOCKET, SO_SNDTIMEO, &idle, sizeof(idle));
+   in = fdopen(self->fd, "r");
+   out = fdopen(dup(self->fd), "w");
+   if(in != NULL && out != NULL){
+      while(fgets(line, sizeof(line), in) != NULL){
+         handleRequest(daemon, line, out);
+         if(fflush(out) != 0){
+            break;
+         }
+      }
+   }
+   if(in != NULL){
+      fclose(in);
+   } else {
+      close(self->fd);
+   }
+   if(out != NULL){
+      fclose(out);
+   }
+
+   pthread_mutex_lock(&daemon->lock);
+   daemon->clients--;
+   pthread_mutex_unlock(&daemon->lock);
+   free(self);
+   return NULL;
+}
+
+static void handleRequest(daemon_state *daemon, char *line, FILE *out){
+   static const char *named[] = {"open", "image", "stats", "close"};
+   char *save, *command = strtok_r(line, " \t\r\n", &save);
+   char *name = command ? strtok_r(NULL, " \t\r\n", &save) : NULL;
+   int i, known = FALSE;
+
+   for(i = 0; command != NULL && i < 4; i++){
+      known = known || strcmp(command, named[i]) == 0;
+   }
+   if(command != NULL && strcmp(command, "list") == 0){
+      listRequest(daemon, out);
+   } else if(known == FALSE){
+      fprintf(out, "error unknown request\n");
+   } else if(name == NULL || strlen(name) >= DAEMON_NAME){
+      fprintf(out, "error bad name\n");
+   } else if(strcmp(command, "open") == 0){
+      openRequest(daemon, name, &save, out);
+   } else if(strcmp(command, "image") == 0){
+      imageRequest(daemon, name, &save, out);
+   } else if(strcmp(command, "stats") == 0){
+      statsRequest(daemon, name, out);
+   } else {
+      closeRequest(daemon, name, out);
+   }
+}
+
+static void openRequest(daemon_state *daemon, const char *name, char **save, FILE *out){
+   nebula_params params = daemon->defaults;
+   long sample_cap = 0;
+   resident *job = NULL;
+   long long *histogram;
+   nebula_context *context;
+   size_t memory;
+   int i;
+
+   params.max_samples = 0;
+   params.target_error = 0;
+   params.time_budget = DAEMON_SLICE_SECONDS;
+   if(parseJob(save, &params, &sample_cap) == FALSE || nebulaValidParams(&params) == FALSE){
+      fprintf(out, "error bad parameters\n");
+      return;
+   }
+   memory = residentMemory(&params);
+
+   // Claim a slot and the memory first, allocate outside the lock
+   pthread_mutex_lock(&daemon->lock);
+   if(findResident(daemon, name) != NULL){
+      pthread_mutex_unlock(&daemon->lock);
+      fprintf(out, "error already open\n");
+      return;
+   }
+   for(i = 0; i < DAEMON_HISTOGRAMS && job == NULL; i++){
+      if(daemon->histograms[i].open == FALSE){
+         job = &daemon->histograms[i];
+      }
+   }
+   if(job == NULL || daemon->memory + memory > (size_t)DAEMON_MEMORY_MB << 20){
+      pthread_mutex_unlock(&daemon->lock);
+      fprintf(out, "error busy\n");
+      return;
+   }
+   job->open = TRUE;
+   job->closing = TRUE;
+   strcpy(job->name, name);
+   daemon->memory += memory;
+   pthread_mutex_unlock(&daemon->lock);
+
+   histogram = nebulaAllocHistogram(&params);
+   context = histogram ? nebulaCreate(&params, histogram) : NULL;
+
+   pthread_mutex_lock(&daemon->lock);
+   job->params = params;
+   job->histogram = histogram;
+   job->context = context;
+   if(context == NULL){
+      releaseResident(daemon, job);
+      fprintf(out, "error out of memory\n");
+   } else {
+      job->sample_cap = sample_cap;
+      job->closing = FALSE;
+
+      // A histogram refined alone now has to take turns
+      for(i = 0; i < DAEMON_HISTOGRAMS; i++){
+         if(daemon->histograms[i].refining && daemon->histograms[i].alone){
+            nebulaStop(daemon->histograms[i].context);
+         }
+      }
+      pthread_cond_signal(&daemon->work);
+      fprintf(out, "ok\n");
+   }
+   pthread_mutex_unlock(&daemon->lock);
+}
+
+static void imageRequest(daemon_state *daemon, const char *name, char **save, FILE *out){
+   char *option, *value;
+   nebula_view view;
+   nebula_params params;
+   resident *job;
+   snapshot *shot = NULL;
+   unsigned char *pixels;
+   size_t size;
+   int valid = TRUE;
+
+   pthread_mutex_lock(&daemon->lock);
+   job = findResident(daemon, name);
+   if(job != NULL && job->published != NULL){
+      shot = job->published;
+      shot->references++;
+      params = job->params;
+   }
+   pthread_mutex_unlock(&daemon->lock);
+   if(shot == NULL){
+      fprintf(out, job == NULL ? "error not open\n" : "error pending\n");
+      return;
+   }
+
+   nebulaDefaultView(params.width, params.height, &view);
+   while((option = strtok_r(NULL, " \t\r\n", save)) != NULL){
+      value = strchr(option, '=');
+      if(value == NULL){
+         valid = FALSE;
+         break;
+      }
+      *value++ = '\0';
+      if(strcmp(option, "x") == 0) view.x = atoi(value);
+      else if(strcmp(option, "y") == 0) view.y = atoi(value);
+      else if(strcmp(option, "w") == 0) view.width = atoi(value);
+      else if(strcmp(option, "h") == 0) view.height = atoi(value);
+      else if(strcmp(option, "scale") == 0) view.scale = atoi(value);
+      else if(strcmp(option, "gamma") == 0) view.gamma = atof(value);
+      else if(strcmp(option, "exposure") == 0) view.exposure = atof(value);
+      else valid = FALSE;
+   }
+
+   size = valid ? nebulaViewSize(&view, params.width, params.height) : 0;
+   pixels = size ? malloc(size) : NULL;
+   if(pixels == NULL){
+      fprintf(out, size ? "error out of memory\n" : "error bad view\n");
+   } else {
+      nebulaToneMapView(shot->histogram, params.width, params.height, shot->channel_max, &view, pixels);
+      fprintf(out, "ok %d %d %ld\n", view.width / view.scale, view.height / view.scale, shot->samples);
+      fwrite(pixels, size, 1, out);
+      free(pixels);
+   }
+
+   pthread_mutex_lock(&daemon->lock);
+   releaseSnapshot(shot);
+   pthread_mutex_unlock(&daemon->lock);
+}
+
+static void statsRequest(daemon_state *daemon, const char *name, FILE *out){
+   resident *job;
+
+   pthread_mutex_lock(&daemon->lock);
+   job = findResident(daemon, name);
+   if(job == NULL){
+      fprintf(out, "error not open\n");
+   } else {
+      fprintf(out, "ok width=%d height=%d min_orbital_length=%d max_orbital_length=%d"
+         " sampler=%s samples=%ld published=%ld sample_cap=%ld\n",
+         job->params.width, job->params.height,
+         job->params.min_orbital_length, job->params.max_orbital_length,
+         nebulaSamplerName(job->params.sampler), job->samples,
+         job->published ? job->published->samples : 0, job->sample_cap);
+   }
+   pthread_mutex_unlock(&daemon->lock);
+}
+
+static void listRequest(daemon_state *daemon, FILE *out){
+   int i;
+
+   pthread_mutex_lock(&daemon->lock);
+   fprintf(out, "ok");
+   for(i = 0; i < DAEMON_HISTOGRAMS; i++){
+      if(daemon->histograms[i].open && !daemon->histograms[i].closing){
+         fprintf(out, " %s", daemon->histograms[i].name);
+      }
+   }
+   fprintf(out, "\n");
+   pthread_mutex_unlock(&daemon->lock);
+}
+
+static void closeRequest(daemon_state *daemon, const char *name, FILE *out){
+   resident *job;
+
+   pthread_mutex_lock(&daemon->lock);
+   job = findResident(daemon, name);
+   if(job == NULL){
+      fprintf(out, "error not open\n");
+   } else if(job->refining){
+      // The refiner frees it once the slice ends
+      job->closing = TRUE;
+      nebulaStop(job->context);
+      fprintf(out, "ok\n");
+   } else {
+      releaseResident(daemon, job);
+      fprintf(out, "ok\n");
+   }
+   pthread_mutex_unlock(&daemon->lock);
+}
+
+// Reads the key=value options of an open request
+static int parseJob(char **save, nebula_params *params, long *sample_cap){
+   static const char *channels[] = {"red", "green", "blue"};
+   static const char *exclusions[] = {"none", "cardioid", "boxes", "all"};
+   char *option, *value;
+   int channel, mode, found;
+
+   while((option = strtok_r(NULL, " \t\r\n", save)) != NULL){
+      value = strchr(option, '=');
+      if(value == NULL){
+         return FALSE;
+      }
+      *value++ = '\0';
+      found = FALSE;
+      if(strcmp(option, "width") == 0){
+         params->width = atoi(value);
+         found = TRUE;
+      } else if(strcmp(option, "height") == 0){
+         params->height = atoi(value);
+         found = TRUE;
+      } else if(strcmp(option, "min") == 0){
+         params->min_orbital_length = atoi(value);
+         found = TRUE;
+      } else if(strcmp(option, "max") == 0){
+         params->max_orbital_length = atoi(value);
+         found = TRUE;
+      } else if(strcmp(option, "importance") == 0){
+         params->importance = atoi(value) != 0;
+         found = TRUE;
+      } else if(strcmp(option, "samples") == 0){
+         *sample_cap = atol(value);
+         found = *sample_cap >= 0;
+      }
+      for(channel = 0; channel < NEBULA_CHANNELS; channel++){
+         if(strcmp(option, channels[channel]) == 0){
+            found = sscanf(value, "%d:%d", &params->channel_min[channel], &params->channel_max[channel]) == 2;
+         }
+      }
+      for(mode = NEBULA_EXCLUDE_NONE; mode <= NEBULA_EXCLUDE_ALL; mode++){
+         if(strcmp(option, "exclusions") == 0 && strcmp(value, exclusions[mode]) == 0){
+            params->exclusions = mode;
+            found = TRUE;
+         }
+      }
+      for(mode = NEBULA_SAMPLER_UNIFORM; mode <= NEBULA_SAMPLER_STRATIFIED; mode++){
+         if(strcmp(option, "sampler") == 0 && strcmp(value, nebulaSamplerName(mode)) == 0){
+            params->sampler = mode;
+            found = TRUE;
+         }
+      }
+      if(found == FALSE){
+         return FALSE;
+      }
+   }
+   return TRUE;
+}
@@ -0,0 +1,34 @@
+/*************************************************/
+/*            NebulaBrot Render Daemon           */
+/*************************************************/
+
+// Keeps named histograms resident and refining in the background, and
+// serves tone mapped views of them over a local Unix socket.
+//
+// One request per line, answered with "ok ..." or "error REASON":
+//
+//    open NAME [key=value...]    start a histogram from the daemon's defaults,
+//                                keys width, height, min, max, red, green,
+//                                blue (MIN:MAX), exclusions, sampler,
+//                                importance (0/1), samples (0 for no limit)
+//    image NAME [key=value...]   "ok WIDTH HEIGHT SAMPLES" then WIDTH*HEIGHT
+//                                RGB bytes, keys x, y, w, h (crop), scale,
+//                                gamma, exposure
+//    stats NAME                  "ok key=value..." on one line
+//    list                        "ok NAME..."
+//    close NAME                  drop the histogram
+//
+// Images come from the last published snapshot, copied about once a second
+// while the histogram is refined, without pausing the sampling threads. A
+// request never waits on them, but may see the last orbits partly traced.
+
+#ifndef NEBULA_DAEMON_H
+#define NEBULA_DAEMON_H
+
+#include "nebula.h"
+
+// Listens on the socket at path until killed, opening histograms with the
+// given defaults. Returns the process exit status if it cannot listen.
+int nebulaServe(const char *path, const nebula_params *defaults);
+
+#endif
@@ -0,0 +1,336 @@
+/*************************************************/
+/*            NebulaBrot Histogram Deltas        */
+/*************************************************/
+
+// Shards of one long render ship what their histogram gained since the last
+// export instead of the whole histogram. A delta lists the changed cells as
+// varint gaps from the previous changed cell and zigzag varint increments,
+// so its size follows the splats since the last export, not the image:
+//
+//    "NBD2" width height hit_weight samples entries (gap increment)...
+//
+// "NBD1" deltas have no hit weight and are read as weight 1.
+//
+// The aggregate is a histogram file, a fixed header followed by the cells as
+// 64-bit integers in host byte order, which deltas are added to in place.
+// Counts of another hit weight are on another scale, so a delta or histogram
+// is only added to a file of its own size and weight.
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "internal.h"
+
+// Initial capacity of a delta's encoding, doubled as needed
+#define DELTA_BUFFER 65536
+
+// Largest width * height of a delta or histogram file, so no size overflows
+#define DELTA_MAX_PIXELS (1ULL << 40)
+
+typedef struct _histogram_header {
+   char magic[4];                // "NBH1"
+   int32_t width;
+   int32_t height;
+   int32_t hit_weight;           // 0 in files from before it was recorded, read as 1
+   int64_t samples;
+} histogram_header;
+
+struct _nebula_delta {
+   const long long *histogram;
+   long long *exported;          // The histogram as of the last export
+   int width;
+   int height;
+   long long hit_weight;
+   unsigned char *buffer;
+   size_t size;
+   size_t capacity;
+};
+
+static int putVarint(nebula_delta *delta, unsigned long long value);
+static int getVarint(FILE *file, unsigned long long *value);
+static unsigned char *getVarintBuffer(unsigned char *buffer, unsigned long long *value);
+static int validHeader(const histogram_header *header, off_t size);
+static histogram_header *mapHistogram(const char *filename, unsigned long long width, unsigned long long height,
+   long long hit_weight, int *fd, size_t *length);
+
+
+nebula_delta *nebulaDeltaCreate(const long long *histogram, int width, int height, long long hit_weight){
+   nebula_delta *delta = calloc(1, sizeof(nebula_delta));
+   size_t cells = (size_t)width * height * CHANNELS, i;
+
+   if(delta == NULL){
+      return NULL;
+   }
+   delta->histogram = histogram;
+   delta->width = width;
+   delta->height = height;
+   delta->hit_weight = hit_weight;
+   delta->exported = malloc(cells * sizeof(long long));
+   if(delta->exported == NULL){
+      free(delta);
+      return NULL;
+   }
+   for(i = 0; i < cells; i++){
+      delta->exported[i] = __atomic_load_n(&histogram[i], __ATOMIC_RELAXED);
+   }
+   return delta;
+}
+
+void nebulaDeltaDestroy(nebula_delta *delta){
+   if(delta != NULL){
+      free(delta->exported);
+      free(delta->buffer);
+      free(delta);
+   }
+}
+
+// The scan reads each cell once, so a delta taken while the splat workers
+// run holds whatever each cell had reached, and the next picks up the rest.
+// The cells only count as exported once the file is written.
+long nebulaExportDelta(nebula_delta *delta, const char *filename, long long samples){
+   size_t cells = (size_t)delta->width * delta->height * CHANNELS, i, previous = 0, entries_size;
+   unsigned long long entries = 0, gap, value;
+   long long increment;
+   unsigned char *entry;
+   FILE *file;
+   int ok = TRUE;
+
+   delta->size = 0;
+   for(i = 0; i < cells && ok; i++){
+      increment = __atomic_load_n(&delta->histogram[i], __ATOMIC_RELAXED) - delta->exported[i];
+      if(increment != 0){
+         ok = putVarint(delta, i - previous)
+            && putVarint(delta, ((unsigned long long)increment << 1) ^ (unsigned long long)(increment >> 63));
+         previous = i + 1;
+         entries++;
+      }
+   }
+
+   // The header is encoded after the entries it counts and written first
+   entries_size = delta->size;
+   ok = ok && putVarint(delta, delta->width) && putVarint(delta, delta->height)
+      && putVarint(delta, delta->hit_weight) && putVarint(delta, samples) && putVarint(delta, entries);
+   file = ok ? fopen(filename, "wb") : NULL;
+   if(file == NULL){
+      return -1;
+   }
+   ok = fwrite("NBD2", 4, 1, file) == 1
+      && fwrite(delta->buffer + entries_size, delta->size - entries_size, 1, file) == 1
+      && (entries_size == 0 || fwrite(delta->buffer, entries_size, 1, file) == 1);
+   ok = fclose(file) == 0 && ok;
+   if(ok == FALSE){
+      return -1;
+   }
+
+   for(entry = delta->buffer, i = 0; entry < delta->buffer + entries_size; i++){
+      entry = getVarintBuffer(entry, &gap);
+      entry = getVarintBuffer(entry, &value);
+      i += gap;
+      delta->exported[i] += (long long)(value >> 1) ^ -(long long)(value & 1);
+   }
+   return 4 + delta->size;
+}
+
+// Adds a delta to the histogram file, creating it at the delta's size. The
+// file is locked while the delta is added, so shards may apply their own.
+int nebulaApplyDelta(const char *histogram_file, const char *delta_file){
+   unsigned long long width, height, hit_weight = 1, samples, entries, gap, value, i;
+   histogram_header *mapped = MAP_FAILED;
+   FILE *file = fopen(delta_file, "rb");
+   char magic[4];
+   size_t length = 0, cell = 0, cells = 0;
+   int fd = -1, ok, weighted = FALSE;
+   long long *counts;
+
+   ok = file != NULL && fread(magic, 4, 1, file) == 1
+      && (memcmp(magic, "NBD1", 4) == 0 || (weighted = memcmp(magic, "NBD2", 4) == 0))
+      && getVarint(file, &width) && getVarint(file, &height)
+      && (weighted == FALSE || getVarint(file, &hit_weight))
+      && getVarint(file, &samples) && getVarint(file, &entries)
+      && width > 0 && height > 0 && width <= INT32_MAX && height <= INT32_MAX
+      && width * height <= DELTA_MAX_PIXELS && hit_weight > 0 && hit_weight <= INT32_MAX;
+   if(ok){
+      cells = width * height * CHANNELS;
+      mapped = mapHistogram(histogram_file, width, height, hit_weight, &fd, &length);
+   }
+   ok = ok && mapped != MAP_FAILED;
+
+   // Entries are checked before anything is added, a bad delta changes
+   // nothing. The gap is compared before it is added, so it can't wrap.
+   if(ok){
+      long start = ftell(file);
+      for(i = 0; i < entries && ok; i++){
+         ok = getVarint(file, &gap) && getVarint(file, &value) && gap < cells - cell;
+         cell += gap + 1;
+      }
+      ok = ok && fseek(file, start, SEEK_SET) == 0;
+   }
+   if(ok){
+      counts = (long long *)(mapped + 1);
+      for(cell = 0, i = 0; i < entries; i++){
+         getVarint(file, &gap);
+         getVarint(file, &value);
+         cell += gap;
+         counts[cell++] += (long long)(value >> 1) ^ -(long long)(value & 1);
+      }
+      mapped->samples += samples;
+   }
+
+   if(mapped != MAP_FAILED){
+      munmap(mapped, length);
+   }
+   if(fd >= 0){
+      close(fd);
+   }
+   if(file != NULL){
+      fclose(file);
+   }
+   return ok;
+}
+
+// Adds a whole histogram to the file, as a delta from zero would
+int nebulaAddHistogram(const char *histogram_file, const long long *histogram, int width, int height,
+      long long samples, long long hit_weight){
+   size_t cells = (size_t)width * height * CHANNELS, length, i;
+   histogram_header *mapped;
+   long long *counts;
+   int fd = -1;
+
+   if(width <= 0 || height <= 0 || hit_weight <= 0 || hit_weight > INT32_MAX){
+      return FALSE;
+   }
+   mapped = mapHistogram(histogram_file, width, height, hit_weight, &fd, &length);
+   if(mapped != MAP_FAILED){
+      counts = (long long *)(mapped + 1);
+      for(i = 0; i < cells; i++){
+         counts[i] += histogram[i];
+      }
+      mapped->samples += samples;
+      munmap(mapped, length);
+   }
+   if(fd >= 0){
+      close(fd);
+   }
+   return mapped != MAP_FAILED;
+}
+
+// Reads a histogram file into a new array, NULL if it can't be read. The
+// file is locked shared, so a delta being applied is read whole or not at all.
+long long *nebulaLoadHistogram(const char *filename, int *width, int *height, long long *samples){
+   histogram_header header;
+   FILE *file = fopen(filename, "rb");
+   long long *histogram = NULL;
+   size_t cells;
+   struct stat status;
+
+   if(file == NULL){
+      return NULL;
+   }
+   if(flock(fileno(file), LOCK_SH) == 0 && fstat(fileno(file), &status) == 0
+         && fread(&header, sizeof(header), 1, file) == 1
+         && validHeader(&header, status.st_size)){
+      cells = (size_t)header.width * header.height * CHANNELS;
+      histogram = malloc(cells * sizeof(long long));
+      if(histogram != NULL && fread(histogram, sizeof(long long), cells, file) != cells){
+         free(histogram);
+         histogram = NULL;
+      }
+      *width = header.width;
+      *height = header.height;
+      *samples = header.samples;
+   }
+   fclose(file);
+   return histogram;
+}
+
+// Opens the histogram file locked and maps it, creating it at the given size
+// and hit weight if it is empty. MAP_FAILED if it holds another size or
+// weight or can't be mapped, the lock goes when the caller closes fd.
+static histogram_header *mapHistogram(const char *filename, unsigned long long width, unsigned long long height,
+      long long hit_weight, int *fd, size_t *length){
+   histogram_header header, *mapped = MAP_FAILED;
+   struct stat status;
+   int ok;
+
+   *length = sizeof(histogram_header) + width * height * CHANNELS * sizeof(long long);
+   *fd = open(filename, O_RDWR | O_CREAT, 0644);
+   ok = *fd >= 0 && flock(*fd, LOCK_EX) == 0 && fstat(*fd, &status) == 0;
+   if(ok && status.st_size == 0){
+      memset(&header, 0, sizeof(header));
+      memcpy(header.magic, "NBH1", 4);
+      header.width = width;
+      header.height = height;
+      header.hit_weight = hit_weight;
+      ok = ftruncate(*fd, *length) == 0 && pwrite(*fd, &header, sizeof(header), 0) == sizeof(header);
+      status.st_size = *length;
+   }
+   if(ok && (size_t)status.st_size == *length){
+      mapped = mmap(NULL, *length, PROT_READ | PROT_WRITE, MAP_SHARED, *fd, 0);
+   }
+   if(mapped != MAP_FAILED && (validHeader(mapped, *length) == FALSE
+         || mapped->width != (int32_t)width || mapped->height != (int32_t)height
+         || (mapped->hit_weight ? mapped->hit_weight : 1) != hit_weight)){
+      munmap(mapped, *length);
+      mapped = MAP_FAILED;
+   }
+   return mapped;
+}
+
+static int putVarint(nebula_delta *delta, unsigned long long value){
+   unsigned char *grown;
+
+   if(delta->capacity - delta->size < 10){
+      grown = realloc(delta->buffer, delta->capacity ? 2 * delta->capacity : DELTA_BUFFER);
+      if(grown == NULL){
+         return FALSE;
+      }
+      delta->buffer = grown;
+      delta->capacity = delta->capacity ? 2 * delta->capacity : DELTA_BUFFER;
+   }
+   while(value >= 0x80){
+      delta->buffer[delta->size++] = (value & 0x7F) | 0x80;
+      value >>= 7;
+   }
+   delta->buffer[delta->size++] = value;
+   return TRUE;
+}
+
+static int getVarint(FILE *file, unsigned long long *value){
+   int byte, shift;
+
+   *value = 0;
+   for(shift = 0; shift < 64; shift += 7){
+      if((byte = getc(file)) == EOF){
+         return FALSE;
+      }
+      *value |= (unsigned long long)(byte & 0x7F) << shift;
+      if((byte & 0x80) == 0){
+         return TRUE;
+      }
+   }
+   return FALSE;
+}
+
+static unsigned char *getVarintBuffer(unsigned char *buffer, unsigned long long *value){
+   int shift = 0;
+
+   *value = 0;
+   do {
+      *value |= (unsigned long long)(*buffer & 0x7F) << shift;
+      shift += 7;
+   } while(*buffer++ & 0x80);
+   return buffer;
+}
+
+static int validHeader(const histogram_header *header, off_t size){
+   return memcmp(header->magic, "NBH1", 4) == 0 && header->width > 0 && header->height > 0
+      && (size_t)size == sizeof(histogram_header)
+         + (size_t)header->width * header->height * CHANNELS * sizeof(long long);
+}
@@ -0,0 +1,233 @@
+/*************************************************/
+/*              NebulaBrot Output                */
+/*************************************************/
+
+// Tone mapping and the files written for each render
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <math.h>
+
+#include "internal.h"
+
+#pragma pack(1)
+struct BMPHeader
+{
+    char bfType[2];       /* "BM" */
+    int bfSize;           /* Size of file in bytes */
+    int bfReserved;       /* set to 0 */
+    int bfOffBits;        /* Byte offset to actual bitmap data (= 54) */
+    int biSize;           /* Size of BITMAPINFOHEADER, in bytes (= 40) */
+    int biWidth;          /* Width of image, in pixels */
+    int biHeight;         /* Height of images, in pixels */
+    short biPlanes;       /* Number of planes in target device (set to 1) */
+    short biBitCount;     /* Bits per pixel (24 in this case) */
+    int biCompression;    /* Type of compression (0 if no compression) */
+    int biSizeImage;      /* Image size, in bytes (0 if no compression) */
+    int biXPelsPerMeter;  /* Resolution in pixels/meter of display device */
+    int biYPelsPerMeter;  /* Resolution in pixels/meter of display device */
+    int biClrUsed;        /* Number of colors in the color table (if 0, use
+                             maximum allowed by biBitCount) */
+    int biClrImportant;   /* Number of important colors.  If 0, all colors
+                             are important */
+};
+#pragma pack(0)
+
+
+void nebulaToneMap(const long long *histogram, int width, int height, unsigned char *pixels){
+   size_t pixel, count = (size_t)width * height;
+   int channel;
+   unsigned char color;
+   long long channel_max[CHANNELS];
+
+   nebulaHistogramMax(histogram, width, height, channel_max);
+
+   // Scaled from the full count, weighted counts overflow a byte
+   for(channel = 0; channel < CHANNELS; channel++){
+      for(pixel = 0; pixel < count; pixel++){
+         color = 0;
+         if(channel_max[channel] > 0){
+            color = 255*cbrt(histogram[pixel * CHANNELS + channel])/cbrt(channel_max[channel]);
+         }
+         pixels[pixel * RGB + channel] = color;
+      }
+   }
+}
+
+void nebulaHistogramMax(const long long *histogram, int width, int height, long long *channel_max){
+   size_t pixel, count = (size_t)width * height;
+   int channel;
+
+   for(channel = 0; channel < CHANNELS; channel++){
+      channel_max[channel] = 0;
+   }
+   for(pixel = 0; pixel < count; pixel++){
+      for(channel = 0; channel < CHANNELS; channel++){
+         if(histogram[pixel * CHANNELS + channel] > channel_max[channel]){
+            channel_max[channel] = histogram[pixel * CHANNELS + channel];
+         }
+      }
+   }
+}
+
+void nebulaDefaultView(int width, int height, nebula_view *view){
+   view->x = 0;
+   view->y = 0;
+   view->width = width;
+   view->height = height;
+   view->scale = 1;
+   view->gamma = 1.0 / 3;
+   view->exposure = 1;
+}
+
+size_t nebulaViewSize(const nebula_view *view, int width, int height){
+   if(view->scale < 1 || view->gamma <= 0 || view->exposure <= 0
+         || view->x < 0 || view->y < 0 || view->width < view->scale || view->height < view->scale
+         || view->width > width - view->x || view->height > height - view->y){
+      return 0;
+   }
+   return (size_t)(view->width / view->scale) * (view->height / view->scale) * RGB;
+}
+
+int nebulaToneMapView(const long long *histogram, int width, int height,
+      const long long *channel_max, const nebula_view *view, unsigned char *pixels){
+   long long scanned[CHANNELS];
+   int out_width = view->width / view->scale, out_height = view->height / view->scale;
+   int x, y, a, b, channel;
+   double total, value, scale[CHANNELS];
+
+   if(nebulaViewSize(view, width, height) == 0){
+      return FALSE;
+   }
+   if(channel_max == NULL){
+      nebulaHistogramMax(histogram, width, height, scanned);
+      channel_max = scanned;
+   }
+   // Box sums are averaged, then taken relative to the brightest pixel
+   for(channel = 0; channel < CHANNELS; channel++){
+      scale[channel] = channel_max[channel] > 0
+         ? view->exposure / ((double)channel_max[channel] * view->scale * view->scale) : 0;
+   }
+
+   for(y = 0; y < out_height; y++){
+      for(x = 0; x < out_width; x++){
+         for(channel = 0; channel < CHANNELS; channel++){
+            total = 0;
+            for(b = 0; b < view->scale; b++){
+               const long long *row = &histogram[((size_t)(view->y + y * view->scale + b) * width
+                  + view->x + x * view->scale) * CHANNELS + channel];
+               for(a = 0; a < view->scale; a++){
+                  total += row[a * CHANNELS];
+               }
+            }
+            value = pow(total * scale[channel], view->gamma);
+            pixels[((size_t)y * out_width + x) * RGB + channel] = value >= 1 ? 255 : 255 * value;
+         }
+      }
+   }
+   return TRUE;
+}
+
+int nebulaWriteBmp(const char* filename, int width, int height, const unsigned char *pixels){
+   int y = 0, x = 0;
+
+   FILE *file;
+   struct BMPHeader bmph;
+
+   /* The length of each line must be a multiple of 4 bytes */
+
+   int bytesPerLine = (3 * (width + 1) / 4) * 4;
+
+   bmph.bfType[0] = 'B';
+   bmph.bfType[1] = 'M';
+   bmph.bfOffBits = 54;
+   bmph.bfSize = bmph.bfOffBits + bytesPerLine * height;
+   bmph.bfReserved = 0;
+   bmph.biSize = 40;
+   bmph.biWidth = width;
+   bmph.biHeight = height;
+   bmph.biPlanes = 1;
+   bmph.biBitCount = 24;
+   bmph.biCompression = 0;
+   bmph.biSizeImage = bytesPerLine * height;
+   bmph.biXPelsPerMeter = 0;
+   bmph.biYPelsPerMeter = 0;
+   bmph.biClrUsed = 0;
+   bmph.biClrImportant = 0;
+   file = fopen (filename, "wb");
+   if (file == NULL) return(0);
+   fwrite(&bmph, sizeof(bmph), 1, file);
+   // Sized at run time, too big for the stack at the default resolution
+   size_t tableSize = (size_t)bytesPerLine * height;
+   char *bmpColorTable = calloc(tableSize, 1);
+   if (bmpColorTable == NULL){
+      fclose(file);
+      return(0);
+   }
+   while(y < height){
+      x = 0;
+      while(x < width){
+         size_t bmpPxOffset = (size_t)y * bytesPerLine + BYTES_PER_PIXEL * x;
+         size_t imagePxOffset = RGB * ((size_t)y * width + x);
+         bmpColorTable[bmpPxOffset    ] = pixels[imagePxOffset + 2];
+         bmpColorTable[bmpPxOffset + 1] = pixels[imagePxOffset + 1];
+         bmpColorTable[bmpPxOffset + 2] = pixels[imagePxOffset    ];
+         x++;
+      }
+      y++;
+   }
+   fwrite(bmpColorTable, tableSize, 1, file);
+   free(bmpColorTable);
+   fclose(file);
+
+   return(1);
+}
+
+// Records the job and how it ended, as key=value lines
+int nebulaWriteMetadata(const char *filename, const char *image,
+      const nebula_params *params, const nebula_stats *stats){
+   static const char *channels[] = {"red", "green", "blue"};
+   FILE *file;
+   int channel;
+
+   file = fopen(filename, "w");
+   if (file == NULL) return(0);
+
+   fprintf(file, "image=%s\n", image);
+   fprintf(file, "width=%d\n", params->width);
+   fprintf(file, "height=%d\n", params->height);
+   fprintf(file, "min_orbital_length=%d\n", params->min_orbital_length);
+   fprintf(file, "max_orbital_length=%d\n", params->max_orbital_length);
+   fprintf(file, "sampler=%s\n", nebulaSamplerName(params->sampler));
+   if(params->importance){
+      fprintf(file, "importance_coverage=%.4f\n", stats->importance_coverage);
+   }
+   fprintf(file, "cascade=%s\n", params->cascade ? "on" : "off");
+   fprintf(file, "hit_weight=%lld\n", stats->hit_weight);
+   fprintf(file, "samples=%ld\n", stats->samples);
+   fprintf(file, "seconds=%.2f\n", stats->seconds);
+   fprintf(file, "stop_reason=%s\n", stats->stop_reason);
+   if(stats->survivors > 0){
+      fprintf(file, "survivors=%lld\n", stats->survivors);
+   }
+   for(channel = 0; channel < CHANNELS; channel++){
+      if(stats->estimated_error[channel] < 0){
+         fprintf(file, "estimated_error_%s=unknown\n", channels[channel]);
+      } else {
+         fprintf(file, "estimated_error_%s=%.6f\n", channels[channel], stats->estimated_error[channel]);
+      }
+   }
+   fclose(file);
+
+   return(1);
+}
+
+const char *nebulaSamplerName(int sampler){
+   static const char *samplers[] = {"uniform", "halton", "sobol", "stratified"};
+
+   if(sampler < SAMPLER_UNIFORM || sampler > SAMPLER_STRATIFIED){
+      return "unknown";
+   }
+   return samplers[sampler];
+}
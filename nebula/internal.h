@@ -0,0 +1,405 @@
+/*************************************************/
+/*         NebulaBrot Renderer Internals         */
+/*************************************************/
+
+// Shared between the library's translation units, not part of the API
+
+#ifndef NEBULA_INTERNAL_H
+#define NEBULA_INTERNAL_H
+
+#include <stdio.h>
+#include <stdatomic.h>
+#include <pthread.h>
+
+#include "nebula.h"
+
+/*************************************************/
+/*                  Default Job                  */
+/*************************************************/
+
+// nebulaDefaultParams(), the buddahbrot render
+#define WIDTH 2200
+#define HEIGHT 2200
+#define MAX_ORBITAL_LENGTH 105
+#define MIN_ORBITAL_LENGTH 100
+#define MAX_SAMPLES 100000
+#define CHANNEL_MAX 100000
+#define CHANNEL_MIN 1
+
+// Sets multiple for printouts to be displayed
+#define TICKER 10000
+
+/*************************************************/
+/*               Pipeline Variables              */
+/*************************************************/
+
+// Slots in the ring between the search and splat stages (Must Be Power Of 2)
+// A full ring holds the search stage back, so memory stays bounded
+#define RING_SIZE 4096
+
+// Candidates drawn and filtered by the search stage per batch
+#define SEARCH_BATCH 256
+
+// Accepted orbits timed on one thread to balance the two stages, for at most
+// CALIBRATION_SECONDS, or CALIBRATION_SHARE of a time budget. The orbits count
+// toward the run, so on rare windows the timing costs only the parallelism.
+#define CALIBRATION_SAMPLES 200
+#define CALIBRATION_SECONDS 0.25
+#define CALIBRATION_SHARE 0.25
+
+// Points run side by side by the vector escape test
+#define ESCAPE_LANES 4
+
+// Search cascade: draws escaping in double precision CASCADE_MARGIN short of
+// the orbital window are ruled out without long double. The two precisions
+// part ways only on orbits that stay near the boundary for hundreds of
+// iterations, after which their lengths differ by up to about a third.
+// Orbits are checked for cycles from CASCADE_PERIOD_START iterations on,
+// closing up within CASCADE_PERIOD_TOLERANCE / max_orbital_length^2. An
+// orbit escaping before the cap moves further than that per cycle near the
+// boundary, so only points that never escape are ruled out as periodic.
+#define CASCADE_MARGIN 0.5
+#define CASCADE_PERIOD_START 16
+#define CASCADE_PERIOD_TOLERANCE 1e-3
+
+// Orbit points splatted together, their cells prefetched before the adds
+// (Must Be A Multiple Of ESCAPE_LANES)
+#define SPLAT_BLOCK 32
+
+// Upper bound on worker threads across both stages
+#define MAX_WORKERS 64
+
+// Upper bound on NUMA nodes, each may hold a replica of the histogram
+#define MAX_NODES 64
+
+// Convergence checks: the histogram is compared with the snapshot of the last
+// checkpoint each time the sample count grows by CHECKPOINT_RATIO, starting
+// from CHECKPOINT_SAMPLES, so a run stops at most that factor past its target
+// error. The budget and checkpoints are polled every MONITOR_INTERVAL
+// microseconds.
+#define CHECKPOINT_SAMPLES 1000
+#define CHECKPOINT_RATIO 1.25
+#define MONITOR_INTERVAL 100000
+
+/*************************************************/
+/*               Sampling Variables              */
+/*************************************************/
+
+// Strata per axis for the stratified sampler (Must Be Power Of 2)
+#define STRATA_PER_AXIS 1024
+
+// Importance sampling: a prepass measures escape times on a grid of cells
+// over the sampling square, probed IMPORTANCE_PROBES^2 times each. Cells are
+// drawn in proportion to their accepted probes, plus IMPORTANCE_FLOOR probes'
+// worth so cells near the boundary without an accepted probe are still drawn.
+// Cells whose whole neighbourhood escapes before IMPORTANCE_REACH of the
+// minimum orbital length, or never escapes, get no share of their own.
+// IMPORTANCE_SPREAD of the draws are spread evenly over every cell, so a
+// cell the prepass missed is still sampled and no weight exceeds
+// 1 / IMPORTANCE_SPREAD.
+#define IMPORTANCE_GRID 256
+#define IMPORTANCE_PROBES 4
+#define IMPORTANCE_FLOOR 0.25
+#define IMPORTANCE_REACH 0.5
+#define IMPORTANCE_SPREAD 0.05
+
+// Hits from importance sampled orbits are weighted by the inverse of their
+// sampling probability, in fixed point with IMPORTANCE_WEIGHT per uniform hit
+#define IMPORTANCE_WEIGHT 1024
+
+/*************************************************/
+/*               Static Definitions              */
+/*************************************************/
+
+#define RGB NEBULA_RGB
+#define CHANNELS NEBULA_CHANNELS
+#define BYTES_PER_PIXEL 3
+#define RAND_RANGE 2
+#define MAX_SQUARE_DIST 4
+#define TRUE 1
+#define FALSE 0
+
+#define EXCLUDE_NONE NEBULA_EXCLUDE_NONE
+#define EXCLUDE_CARDIOID NEBULA_EXCLUDE_CARDIOID
+#define EXCLUDE_BOXES NEBULA_EXCLUDE_BOXES
+#define EXCLUDE_ALL NEBULA_EXCLUDE_ALL
+
+#define SAMPLER_UNIFORM NEBULA_SAMPLER_UNIFORM
+#define SAMPLER_HALTON NEBULA_SAMPLER_HALTON
+#define SAMPLER_SOBOL NEBULA_SAMPLER_SOBOL
+#define SAMPLER_STRATIFIED NEBULA_SAMPLER_STRATIFIED
+
+// Placements of nebPlacedAlloc() other than a node of the topology
+#define PLACE_FIRST_TOUCH -2
+#define PLACE_INTERLEAVE -1
+
+// Dimensions 0 and 1 place the point, dimension 2 picks its importance cell
+#define SEQUENCE_DIMENSIONS 3
+#define SEQUENCE_BITS 64
+#define HALTON_DIGITS_3 40
+#define HALTON_DIGITS_5 27
+
+typedef nebula_params render_params;
+
+// Lanes of the vector escape test, as GCC vector extensions
+typedef double double_lanes __attribute__((vector_size(ESCAPE_LANES * sizeof(double))));
+typedef long long length_lanes __attribute__((vector_size(ESCAPE_LANES * sizeof(long long))));
+
+typedef struct _neb_complex {
+   long double real;
+   long double imag;
+} neb_complex;
+
+// Accepted point handed from the search stage to the splat stage
+typedef struct _candidate {
+   neb_complex c;
+   int orbital_length;
+   long long weight;
+} candidate;
+
+// Orbit kept in a survivors table, z and orbital_length as nebContinueOrbit()
+// left them
+typedef struct _survivor {
+   neb_complex c;
+   neb_complex z;
+   int orbital_length;
+   double weight;                // Uniform hits per hit
+} survivor;
+
+// Bounded lock-free multi-producer/multi-consumer queue of candidates.
+// Each cell's sequence number says whether it is free for the producer
+// at that position or holds a value for the consumer at that position.
+typedef struct _ring_cell {
+   atomic_size_t sequence;
+   candidate value;
+} ring_cell;
+
+typedef struct _candidate_ring {
+   ring_cell cells[RING_SIZE];
+   _Alignas(64) atomic_size_t head;
+   _Alignas(64) atomic_size_t tail;
+} candidate_ring;
+
+// Per job scrambling of the low-discrepancy sequences. Search batches claim
+// consecutive blocks of sequence indices, so workers never share a point.
+typedef struct _sequence_state {
+   atomic_ullong next_index;
+   unsigned long long sobol_direction[SEQUENCE_DIMENSIONS][SEQUENCE_BITS];
+   unsigned long long sobol_shift[SEQUENCE_DIMENSIONS];
+   unsigned char halton_2[SEQUENCE_BITS][2];
+   unsigned char halton_3[HALTON_DIGITS_3][3];
+   unsigned char halton_5[HALTON_DIGITS_5][5];
+} sequence_state;
+
+// Alias table over the cells of the importance prepass grid
+typedef struct _importance_map {
+   int size;
+   double *probability;
+   int *alias;
+   double *weight;
+   double coverage;
+} importance_map;
+
+// CPUs this process may use, interleaved across the nodes they belong to
+typedef struct _memory_topology {
+   int nodes;
+   int node_id[MAX_NODES];       // System node number of each node
+   int cpus;
+   int cpu[MAX_WORKERS];
+   int cpu_node[MAX_WORKERS];    // Index into node_id of each CPU
+} memory_topology;
+
+// Survivors table carried on by the run, and the one it keeps, see survivor.c
+typedef struct _survivor_table {
+   const unsigned char *input;   // Mapped table, NULL unless resuming
+   size_t input_length;
+   long long input_records;
+   atomic_llong next_record;     // Claimed SEARCH_BATCH records at a time
+
+   FILE *output;                 // NULL unless keeping survivors
+   atomic_llong output_records;
+} survivor_table;
+
+typedef struct _render_kernel {
+   const char *name;
+   render_params shape;
+   int (*searchBatch)(nebula_context *context, unsigned long long *seed, candidate *accepted);
+   void (*orbitTrace)(nebula_context *context, const candidate *orbit, long long *hit_counter);
+} render_kernel;
+
+typedef struct _worker {
+   pthread_t thread;
+   unsigned long long seed;
+   nebula_context *context;
+   long long *hit_counter;       // The histogram or its replica on this node
+   int cpu;                      // Pinned CPU, -1 if not pinned
+   int alone;                    // A searcher without splat workers, traces its own finds
+} worker;
+
+struct _nebula_context {
+   render_params params;
+   const render_kernel *kernel;
+
+   // Row major, (y * width + x) * CHANNELS + channel, owned by the caller
+   long long *hit_counter;
+
+   // With NEBULA_PLACEMENT_REPLICATE, each node's workers splat into a
+   // replica on that node, which is moved into hit_counter at every sync
+   memory_topology topology;
+   long long *replica[MAX_NODES];
+   int replicas;
+
+   candidate_ring ring;
+
+   // Scrambled by the first run, the following ones carry the sequences on
+   sequence_state sequence;
+   int sequence_ready;
+   importance_map importance;
+   survivor_table survivors;
+
+   // Accepted samples handed out to the search stage and traced by the splat stage
+   atomic_long samples_claimed;
+   atomic_long samples_traced;
+   atomic_int searchers_running;
+
+   // Claims stop at sample_limit, lowered to stop a run early
+   atomic_long sample_limit;
+
+   // Set by nebulaStop(), ends the run going on or the next one
+   atomic_int stop_requested;
+
+   // Share of the workers given to the search stage, timed by the first
+   // run and reused by the following ones, negative until then
+   double search_share;
+
+   // Advanced by every run, so repeated runs draw fresh samples
+   unsigned long long seed;
+
+   // How the last run ended, set by the monitor and nebulaStop() alike
+   _Atomic(const char *) stop_reason;
+   double estimated_error[CHANNELS];
+   double render_seconds;
+};
+
+// render.c
+double nebWallClock();
+unsigned long long nebRandomBits(unsigned long long *seed);
+long double nebRandomUnit(unsigned long long *seed);
+int nebWorkerCount(int requested);
+void nebProgress(const nebula_context *context, const char *format, ...);
+
+
+// memory.c
+void nebMemoryTopology(memory_topology *topology);
+void *nebPlacedAlloc(size_t bytes, const memory_topology *topology, int node, int huge_pages);
+void nebPlacedFree(void *memory, size_t bytes, int huge_pages);
+void nebPinnedAttributes(pthread_attr_t *attributes, int cpu);
+
+// sampler.c
+void nebSequenceInit(nebula_context *context, unsigned long long *seed);
+void nebRadicalInverseBatch(unsigned long long index, int base, int digits,
+   const unsigned char *permutation, long double *values);
+void nebSobolBatch(const sequence_state *sequence, unsigned long long index, int dimension,
+   long double *values);
+int nebBuildImportanceMap(nebula_context *context);
+void nebFreeImportanceMap(nebula_context *context);
+
+// survivor.c
+int nebResumeBatch(nebula_context *context, unsigned long long *seed, candidate *accepted);
+int nebSurvivorsLeft(nebula_context *context);
+void nebKeepSurvivors(nebula_context *context, const survivor *kept, int count);
+void nebKeepUntraced(nebula_context *context, const candidate *orbits, int count);
+int nebFinishSurvivors(nebula_context *context);
+void nebCloseSurvivors(nebula_context *context);
+
+// kernel.c
+const render_kernel *nebSelectKernel(const render_params *params);
+int nebOrbitalLength(neb_complex c, int max_orbital_length);
+int nebContinueOrbit(neb_complex c, neb_complex *z, int orbital_length, int max_orbital_length);
+void nebEscapeLengths(const double *real, const double *imag, int *lengths, int max_orbital_length);
+int nebCascadeFilter(const neb_complex *coords, int *draws, int count, int min_orbital_length,
+   int max_orbital_length, int keep_bounded);
+int nebCheckExclusions(neb_complex z, int exclusions);
+long double nebModulusSquared(neb_complex z);
+
+// Whether an accepted orbit of the length counts in a channel. A channel
+// window covering the whole orbital window always counts, which constant
+// bounds resolve at compile time.
+static inline int channelCounts(int length, int channel_min, int channel_max,
+      int min_orbital_length, int max_orbital_length){
+   return (channel_min <= min_orbital_length && channel_max >= max_orbital_length)
+      || (length < channel_max && length > channel_min);
+}
+
+// Fills a search batch with coordinates from the job's sampler, and the
+// weight of each relative to a uniform draw. Inlined into the search kernels
+// with the rest of their bodies, the sequences themselves are in sampler.c.
+static inline __attribute__((always_inline))
+void nebSampleBatch(nebula_context *context, unsigned long long *seed, neb_complex *coords, double *weights){
+   sequence_state *sequence = &context->sequence;
+   const importance_map *importance = &context->importance;
+   unsigned long long index, stratum, strata = (unsigned long long)STRATA_PER_AXIS * STRATA_PER_AXIS;
+   long double u[SEARCH_BATCH], v[SEARCH_BATCH], w[SEARCH_BATCH], pick;
+   int i, cell, cells = importance->size * importance->size, importance_draw = context->params.importance;
+
+   if(context->params.sampler == SAMPLER_UNIFORM){
+      for(i = 0; i < SEARCH_BATCH; i++){
+         u[i] = nebRandomUnit(seed);
+         v[i] = nebRandomUnit(seed);
+      }
+   } else {
+      index = atomic_fetch_add(&sequence->next_index, SEARCH_BATCH);
+      switch(context->params.sampler){
+         case SAMPLER_HALTON:
+            nebRadicalInverseBatch(index, 2, SEQUENCE_BITS, &sequence->halton_2[0][0], u);
+            nebRadicalInverseBatch(index, 3, HALTON_DIGITS_3, &sequence->halton_3[0][0], v);
+            if(importance_draw){
+               nebRadicalInverseBatch(index, 5, HALTON_DIGITS_5, &sequence->halton_5[0][0], w);
+            }
+            break;
+         case SAMPLER_SOBOL:
+            nebSobolBatch(sequence, index, 0, u);
+            nebSobolBatch(sequence, index, 1, v);
+            if(importance_draw){
+               nebSobolBatch(sequence, index, 2, w);
+            }
+            break;
+         case SAMPLER_STRATIFIED:
+            // An odd multiplier permutes the strata, so a partial sweep is
+            // still spread over the whole square
+            for(i = 0; i < SEARCH_BATCH; i++){
+               stratum = ((index + i) * 0x9E3779B97F4A7C15ULL) & (strata - 1);
+               u[i] = (stratum % STRATA_PER_AXIS + nebRandomUnit(seed)) / STRATA_PER_AXIS;
+               v[i] = (stratum / STRATA_PER_AXIS + nebRandomUnit(seed)) / STRATA_PER_AXIS;
+            }
+            break;
+      }
+   }
+   // Samplers without a third dimension pick cells at random
+   if(importance_draw && (context->params.sampler == SAMPLER_UNIFORM
+         || context->params.sampler == SAMPLER_STRATIFIED)){
+      for(i = 0; i < SEARCH_BATCH; i++){
+         w[i] = nebRandomUnit(seed);
+      }
+   }
+
+   for(i = 0; i < SEARCH_BATCH; i++){
+      weights[i] = 1;
+      if(importance_draw){
+         // Alias draw of a cell by the third dimension, the first two are
+         // the jitter inside it
+         pick = w[i] * cells;
+         cell = pick;
+         if(pick - cell >= importance->probability[cell]){
+            cell = importance->alias[cell];
+         }
+         u[i] = (cell % importance->size + u[i]) / importance->size;
+         v[i] = (cell / importance->size + v[i]) / importance->size;
+         weights[i] = importance->weight[cell];
+      }
+      coords[i].real = RAND_RANGE*(2.0 * u[i] - 1.0);
+      coords[i].imag = RAND_RANGE*(2.0 * v[i] - 1.0);
+   }
+}
+
+#endif
@@ -0,0 +1,461 @@
+/*************************************************/
+/*             NebulaBrot Kernels                */
+/*************************************************/
+
+// Escape-time search and orbit splatting, generic and specialized
+
+#include <stdlib.h>
+#include <math.h>
+
+#include "internal.h"
+
+/*************************************************/
+/*              Specialized Kernels              */
+/*************************************************/
+
+// Configurations compiled with their parameters folded into the kernels.
+// Jobs matching one of these run its kernel, any other job runs the
+// generic kernel which reads the same parameters at run time.
+//   name, width, height, min/max orbital length,
+//   red min/max, green min/max, blue min/max, exclusions
+#define SPECIALIZED_KERNELS(KERNEL) \
+   KERNEL(buddahbrot, 2200, 2200,  100,  105,    1, 100000,    1, 100000,    1, 100000, EXCLUDE_CARDIOID) \
+   KERNEL(preview,    1000, 1000,  100,  105,    1, 100000,    1, 100000,    1, 100000, EXCLUDE_CARDIOID) \
+   KERNEL(nebula,      900,  900,  500, 8000, 2000,   8000, 1300,   5000, 1000,   2000, EXCLUDE_CARDIOID)
+
+/*************************************************/
+/*                  Kernel Bodies                */
+/*************************************************/
+
+// Every caller passes its own parameters, so the specialized kernels get them
+// folded in as constants once these are inlined. The neb functions further
+// down are the same bodies for the rest of the library.
+
+static inline __attribute__((always_inline))
+int checkExclusions(neb_complex z, int exclusions){
+   int to_iterate = TRUE;
+   if(exclusions & EXCLUDE_CARDIOID){
+      int cardioid = FALSE, bulb = FALSE;
+      double p = sqrt(pow((z.real - 0.25), 2) + pow(z.imag, 2));
+
+      if(z.real < p - 2 * pow(p, 2) + 0.25){
+         cardioid = TRUE;
+      }
+      if(pow((z.real+1), 2) + pow(z.imag,2) < (1.0/16)){
+         bulb = TRUE;
+      }
+
+      if(cardioid == TRUE || bulb == TRUE){
+         to_iterate = FALSE;
+      } else {
+         to_iterate = TRUE;
+      }
+   }
+   if(exclusions & EXCLUDE_BOXES){
+      if(
+            (z.real >  -1.2 && z.real <=  -1.1 && z.imag >  -0.1 && z.imag  < 0.1)
+         || (z.real >  -1.1 && z.real <=  -0.9 && z.imag >  -0.2 && z.imag < 0.2)
+         || (z.real >  -0.9 && z.real <=  -0.8 && z.imag >  -0.1 && z.imag < 0.1)
+         || (z.real > -0.69 && z.real <= -0.61 && z.imag >  -0.2 && z.imag < 0.2)
+         || (z.real > -0.61 && z.real <=  -0.5 && z.imag > -0.37 && z.imag < 0.37)
+         || (z.real >  -0.5 && z.real <= -0.39 && z.imag > -0.48 && z.imag < 0.48)
+         || (z.real > -0.39 && z.real <=  0.14 && z.imag > -0.55 && z.imag < 0.55)
+         || (z.real >  0.14 && z.real <   0.29 && z.imag > -0.42 && z.imag < -0.07)
+         || (z.real >  0.14 && z.real <   0.29 && z.imag >  0.07 && z.imag < 0.42)
+      )
+      {
+         to_iterate = FALSE;
+      }
+   }
+   return to_iterate;
+}
+
+static inline __attribute__((always_inline))
+long double modulusSquared(neb_complex z){
+   long double x = z.real;
+   long double y = z.imag;
+
+   return x * x + y * y;
+}
+
+static inline __attribute__((always_inline))
+neb_complex square(neb_complex z){
+   neb_complex result;
+   long double x = z.real;
+   long double y = z.imag;
+
+   result.real = x * x - y * y;
+   result.imag = 2 * x * y;
+
+   return result;
+}
+
+static inline __attribute__((always_inline))
+neb_complex add(neb_complex a, neb_complex b){
+   neb_complex result;
+
+   result.real = a.real + b.real;
+   result.imag = a.imag + b.imag;
+
+   return result;
+}
+
+// Carries on an orbit from z, as nebOrbitalLength() left it at orbital_length
+static inline __attribute__((always_inline))
+int continueOrbit(neb_complex c, neb_complex *z, int orbital_length, int max_orbital_length){
+   neb_complex w = *z;
+
+   while (orbital_length <= max_orbital_length){
+
+      w = add(square(w), c);
+      if(modulusSquared(w) > MAX_SQUARE_DIST){
+         break;
+      }
+      orbital_length++;
+   }
+
+   *z = w;
+   return orbital_length;
+}
+
+// nebOrbitalLength() in double precision of the count points draws picks out
+// of coords, or 0 for those whose orbit closes up on a cycle, which never
+// escape. The whole batch is iterated a step at a time, escaped points
+// dropped as it goes, so the orbits of different points overlap in the
+// pipeline instead of each waiting on its own multiplies.
+static inline __attribute__((always_inline))
+void doubleLengths(const neb_complex *coords, const int *draws, int *lengths, int count, int max_orbital_length){
+   double c_real[SEARCH_BATCH], c_imag[SEARCH_BATCH], z_real[SEARCH_BATCH], z_imag[SEARCH_BATCH];
+   double saved_real[SEARCH_BATCH], saved_imag[SEARCH_BATCH], next_real, next_imag;
+   double tolerance = CASCADE_PERIOD_TOLERANCE / ((double)max_orbital_length * max_orbital_length);
+   int point[SEARCH_BATCH], k, left, active = count, step, periodic;
+
+   for(k = 0; k < count; k++){
+      c_real[k] = coords[draws[k]].real;
+      c_imag[k] = coords[draws[k]].imag;
+      z_real[k] = 0;
+      z_imag[k] = 0;
+      point[k] = k;
+   }
+   for(step = 1; step <= max_orbital_length && active > 0; step++){
+      for(left = 0, k = 0; k < active; k++){
+         next_real = z_real[k] * z_real[k] - z_imag[k] * z_imag[k] + c_real[k];
+         next_imag = 2 * z_real[k] * z_imag[k] + c_imag[k];
+         lengths[point[k]] = step;
+         c_real[left] = c_real[k];
+         c_imag[left] = c_imag[k];
+         z_real[left] = next_real;
+         z_imag[left] = next_imag;
+         point[left] = point[k];
+         left += next_real * next_real + next_imag * next_imag <= MAX_SQUARE_DIST;
+      }
+      active = left;
+      if(step < CASCADE_PERIOD_START){
+         continue;
+      }
+
+      // Compared against z at the last power of two step, by point, which
+      // finds any cycle shorter than the steps since
+      if((step & (step - 1)) == 0){
+         for(k = 0; k < active; k++){
+            saved_real[point[k]] = z_real[k];
+            saved_imag[point[k]] = z_imag[k];
+         }
+         continue;
+      }
+      for(left = 0, k = 0; k < active; k++){
+         periodic = fabs(z_real[k] - saved_real[point[k]]) + fabs(z_imag[k] - saved_imag[point[k]]) < tolerance;
+         lengths[point[k]] = periodic ? 0 : step;
+         c_real[left] = c_real[k];
+         c_imag[left] = c_imag[k];
+         z_real[left] = z_real[k];
+         z_imag[left] = z_imag[k];
+         point[left] = point[k];
+         left += !periodic;
+      }
+      active = left;
+   }
+   for(k = 0; k < active; k++){
+      lengths[point[k]] = max_orbital_length + 1;
+   }
+}
+
+// First pass of the search cascade. Rules out the drawn points escaping in
+// double precision well short of the window, and those found periodic
+// unless bounded orbits are kept as survivors, which needs their long
+// double z. Returns how many draws are left for long double.
+static inline __attribute__((always_inline))
+int cascadeFilter(const neb_complex *coords, int *draws, int count, int min_orbital_length,
+      int max_orbital_length, int keep_bounded){
+   int lengths[SEARCH_BATCH], k, left = 0;
+   int shortest = min_orbital_length * (1 - CASCADE_MARGIN);
+
+   doubleLengths(coords, draws, lengths, count, max_orbital_length);
+   for(k = 0; k < count; k++){
+      if(lengths[k] > shortest || (lengths[k] == 0 && keep_bounded)){
+         draws[left++] = draws[k];
+      }
+   }
+   return left;
+}
+
+// Draws SEARCH_BATCH candidates and keeps those inside the orbital window.
+// With the cascade, only the draws the double precision pass leaves are
+// iterated in long double, which decides as before.
+static inline __attribute__((always_inline))
+int searchBatchKernel(nebula_context *context, unsigned long long *seed, candidate *accepted,
+      int min_orbital_length, int max_orbital_length, int exclusions){
+   neb_complex coords[SEARCH_BATCH];
+   double weights[SEARCH_BATCH], scaled;
+   survivor kept[SEARCH_BATCH];
+   int draws[SEARCH_BATCH];
+   int i, k, count = 0, found = 0, survivors = 0;
+
+   nebSampleBatch(context, seed, coords, weights);
+   for(i = 0; i < SEARCH_BATCH; i++){
+      if(checkExclusions(coords[i], exclusions) == TRUE){
+         draws[count++] = i;
+      }
+   }
+   if(context->params.cascade){
+      count = cascadeFilter(coords, draws, count, min_orbital_length, max_orbital_length,
+         context->survivors.output != NULL);
+   }
+   for(k = 0; k < count; k++){
+      i = draws[k];
+      neb_complex c = coords[i];
+      neb_complex z = {0, 0};
+      int orbital_length = continueOrbit(c, &z, 1, max_orbital_length);
+
+      // Outlasted the window, a deeper run may carry on from here
+      if(orbital_length >= max_orbital_length && context->survivors.output != NULL){
+         kept[survivors].c = c;
+         kept[survivors].z = z;
+         kept[survivors].orbital_length = orbital_length;
+         kept[survivors].weight = weights[i];
+         survivors++;
+      }
+      if(orbital_length < max_orbital_length && orbital_length > min_orbital_length){
+         accepted[found].c = c;
+         accepted[found].orbital_length = orbital_length;
+         accepted[found].weight = 1;
+         if(context->params.importance){
+            // Rounded up with the probability of the fraction, so the
+            // fixed point weight is unbiased
+            scaled = weights[i] * IMPORTANCE_WEIGHT;
+            accepted[found].weight = scaled;
+            if(nebRandomUnit(seed) < scaled - accepted[found].weight){
+               accepted[found].weight++;
+            }
+         }
+         found++;
+      }
+   }
+   if(survivors > 0){
+      nebKeepSurvivors(context, kept, survivors);
+   }
+   return found;
+}
+
+// Works out the cells of a block of orbit points ESCAPE_LANES at a time,
+// dropping points off the frame with a mask, and prefetches them all before
+// the first add, so the cache misses of a block overlap rather than queue
+// behind each atomic. The block is padded to whole lanes with points off
+// the frame.
+static inline __attribute__((always_inline))
+void splatBlock(long long *hit_counter, const double *real, const double *imag, int points,
+      int width, int height, const int counted[CHANNELS], long long weight){
+   long long cells[SPLAT_BLOCK], *cell;
+   double_lanes x, y;
+   length_lanes column, row, inside, index;
+   int i, lane, count = 0, channel;
+
+   for(i = 0; i < points; i += ESCAPE_LANES){
+      for(lane = 0; lane < ESCAPE_LANES; lane++){
+         x[lane] = real[i + lane];
+         y[lane] = imag[i + lane];
+      }
+      column = __builtin_convertvector(x * (double)(width / 4) + (double)(width / 2) - 1, length_lanes);
+      row = __builtin_convertvector(y * (double)(height / 4) + (double)(height / 2) - 1, length_lanes);
+      inside = (column >= 0) & (column < width) & (row >= 0) & (row < height);
+      index = (row * width + column) * CHANNELS;
+
+      // Every lane is stored, only those inside are kept
+      for(lane = 0; lane < ESCAPE_LANES; lane++){
+         cells[count] = index[lane];
+         count -= inside[lane];
+      }
+   }
+   for(i = 0; i < count; i++){
+      __builtin_prefetch(&hit_counter[cells[i]], 1, 1);
+   }
+   for(i = 0; i < count; i++){
+      cell = &hit_counter[cells[i]];
+
+      // Several splat workers share the counters
+      for(channel = 0; channel < CHANNELS; channel++){
+         if(counted[channel]){
+            __atomic_fetch_add(&cell[channel], weight, __ATOMIC_RELAXED);
+         }
+      }
+   }
+}
+
+static inline __attribute__((always_inline))
+void orbitTraceKernel(const candidate *orbit, long long *hit_counter,
+      int width, int height, int min_orbital_length, int max_orbital_length,
+      const int channel_min[CHANNELS], const int channel_max[CHANNELS]){
+   neb_complex c = orbit->c;
+   int orbital_length = orbit->orbital_length;
+   int orbital_step = 1;
+   neb_complex z = {0, 0};
+   int channel, points = 0;
+   int counted[CHANNELS];
+   double real[SPLAT_BLOCK], imag[SPLAT_BLOCK];
+
+   // The channels an orbit lands in don't change along it
+   for(channel = 0; channel < CHANNELS; channel++){
+      counted[channel] = channelCounts(orbital_length, channel_min[channel], channel_max[channel],
+         min_orbital_length, max_orbital_length);
+   }
+
+   // The orbit itself is serial in long double, its points are splatted a
+   // block at a time
+   while (orbital_step < max_orbital_length){
+      z = add(square(z), c);
+      if(modulusSquared(z) > MAX_SQUARE_DIST){
+         break;
+      }
+      real[points] = z.real;
+      imag[points] = z.imag;
+      if(++points == SPLAT_BLOCK){
+         splatBlock(hit_counter, real, imag, points, width, height, counted, orbit->weight);
+         points = 0;
+      }
+      orbital_step++;
+   }
+   if(points > 0){
+      for(; points % ESCAPE_LANES != 0; points++){
+         real[points] = MAX_SQUARE_DIST;
+         imag[points] = MAX_SQUARE_DIST;
+      }
+      splatBlock(hit_counter, real, imag, points, width, height, counted, orbit->weight);
+   }
+}
+
+static int genericSearchBatch(nebula_context *context, unsigned long long *seed, candidate *accepted){
+   const render_params *params = &context->params;
+   return searchBatchKernel(context, seed, accepted, params->min_orbital_length,
+      params->max_orbital_length, params->exclusions);
+}
+
+static void genericOrbitTrace(nebula_context *context, const candidate *orbit, long long *hit_counter){
+   const render_params *params = &context->params;
+   orbitTraceKernel(orbit, hit_counter, params->width, params->height,
+      params->min_orbital_length, params->max_orbital_length,
+      params->channel_min, params->channel_max);
+}
+
+#define DEFINE_KERNEL(NAME, W, H, MIN, MAX, RED_MIN, RED_MAX, GREEN_MIN, GREEN_MAX, BLUE_MIN, BLUE_MAX, EXCLUDE) \
+   static int NAME##SearchBatch(nebula_context *context, unsigned long long *seed, candidate *accepted){ \
+      return searchBatchKernel(context, seed, accepted, MIN, MAX, EXCLUDE); \
+   } \
+   static void NAME##OrbitTrace(nebula_context *context, const candidate *orbit, long long *hit_counter){ \
+      static const int channel_min[CHANNELS] = {RED_MIN, GREEN_MIN, BLUE_MIN}; \
+      static const int channel_max[CHANNELS] = {RED_MAX, GREEN_MAX, BLUE_MAX}; \
+      (void)context; \
+      orbitTraceKernel(orbit, hit_counter, W, H, MIN, MAX, channel_min, channel_max); \
+   }
+SPECIALIZED_KERNELS(DEFINE_KERNEL)
+
+#define KERNEL_ENTRY(NAME, W, H, MIN, MAX, RED_MIN, RED_MAX, GREEN_MIN, GREEN_MAX, BLUE_MIN, BLUE_MAX, EXCLUDE) \
+   {#NAME, {.width = W, .height = H, .min_orbital_length = MIN, .max_orbital_length = MAX, \
+      .channel_min = {RED_MIN, GREEN_MIN, BLUE_MIN}, .channel_max = {RED_MAX, GREEN_MAX, BLUE_MAX}, \
+      .exclusions = EXCLUDE}, NAME##SearchBatch, NAME##OrbitTrace},
+static const render_kernel kernels[] = {
+   SPECIALIZED_KERNELS(KERNEL_ENTRY)
+};
+
+static const render_kernel generic_kernel = {"generic", {0}, genericSearchBatch, genericOrbitTrace};
+
+// Picks the specialized kernel built for these parameters, if there is one
+const render_kernel *nebSelectKernel(const render_params *params){
+   size_t i;
+   int channel, match;
+   for(i = 0; i < sizeof(kernels) / sizeof(kernels[0]); i++){
+      const render_params *shape = &kernels[i].shape;
+      match = shape->width == params->width && shape->height == params->height
+         && shape->min_orbital_length == params->min_orbital_length
+         && shape->max_orbital_length == params->max_orbital_length
+         && shape->exclusions == params->exclusions;
+      for(channel = 0; channel < CHANNELS; channel++){
+         match = match && shape->channel_min[channel] == params->channel_min[channel]
+            && shape->channel_max[channel] == params->channel_max[channel];
+      }
+      if(match){
+         return &kernels[i];
+      }
+   }
+   return &generic_kernel;
+}
+
+/*************************************************/
+/*               Library Functions               */
+/*************************************************/
+
+int nebOrbitalLength(neb_complex c, int max_orbital_length){
+   neb_complex z = {0, 0};
+
+   return continueOrbit(c, &z, 1, max_orbital_length);
+}
+
+int nebContinueOrbit(neb_complex c, neb_complex *z, int orbital_length, int max_orbital_length){
+   return continueOrbit(c, z, orbital_length, max_orbital_length);
+}
+
+int nebCascadeFilter(const neb_complex *coords, int *draws, int count, int min_orbital_length,
+      int max_orbital_length, int keep_bounded){
+   return cascadeFilter(coords, draws, count, min_orbital_length, max_orbital_length, keep_bounded);
+}
+
+int nebCheckExclusions(neb_complex z, int exclusions){
+   return checkExclusions(z, exclusions);
+}
+
+long double nebModulusSquared(neb_complex z){
+   return modulusSquared(z);
+}
+
+// nebOrbitalLength() of ESCAPE_LANES points at once in double precision,
+// with every lane iterated until the last one escapes or the cap is reached
+void nebEscapeLengths(const double *real, const double *imag, int *lengths, int max_orbital_length){
+   double_lanes c_real, c_imag, z_real = {0}, z_imag = {0}, next_real;
+   length_lanes length, running;
+   long long any;
+   int lane, step;
+
+   for(lane = 0; lane < ESCAPE_LANES; lane++){
+      c_real[lane] = real[lane];
+      c_imag[lane] = imag[lane];
+      length[lane] = 1;
+      running[lane] = -1;
+   }
+   for(step = 1; step <= max_orbital_length; step++){
+      next_real = z_real * z_real - z_imag * z_imag + c_real;
+      z_imag = 2 * z_real * z_imag + c_imag;
+      z_real = next_real;
+
+      // Comparisons give -1 in the lanes where they hold
+      running &= (length_lanes)(z_real * z_real + z_imag * z_imag <= MAX_SQUARE_DIST);
+      length -= running;
+      for(any = 0, lane = 0; lane < ESCAPE_LANES; lane++){
+         any |= running[lane];
+      }
+      if(any == 0){
+         break;
+      }
+   }
+   for(lane = 0; lane < ESCAPE_LANES; lane++){
+      lengths[lane] = length[lane];
+   }
+}
@@ -0,0 +1,205 @@
+/*************************************************/
+/*          NebulaBrot Memory Placement          */
+/*************************************************/
+
+// Histogram placement across NUMA nodes, huge page backing and worker
+// pinning. The splat stage is a stream of random atomic adds, so where the
+// counters live decides most of its speed. Placement goes through the
+// mbind system call directly rather than libnuma.
+
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <sched.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+
+#include "internal.h"
+
+// Memory policies of mbind(2)
+#define MPOL_PREFERRED 1
+#define MPOL_INTERLEAVE 3
+
+#define HUGE_PAGE_BYTES (2 << 20)
+
+static int parseCpuList(const char *list, const cpu_set_t *allowed, int *cpus, int capacity);
+static int bindMemory(void *memory, size_t bytes, int mode, const memory_topology *topology, int node);
+static size_t placedLength(size_t bytes, int huge_pages);
+
+
+// Reads the nodes and their CPUs from sysfs, keeping the CPUs this process
+// may run on. Without sysfs everything is one node. The whole affinity mask
+// is looked at, only how many CPUs are kept is capped. If none are found a
+// single unpinned CPU, -1, stands in for them.
+void nebMemoryTopology(memory_topology *topology){
+   int node_cpus[MAX_NODES][MAX_WORKERS], node_count[MAX_NODES];
+   char path[64], list[1024];
+   cpu_set_t allowed;
+   FILE *file;
+   int node, found, i, round;
+
+   memset(topology, 0, sizeof(*topology));
+   CPU_ZERO(&allowed);
+   if(sched_getaffinity(0, sizeof(allowed), &allowed) != 0){
+      for(i = 0; i < CPU_SETSIZE && i < sysconf(_SC_NPROCESSORS_ONLN); i++){
+         CPU_SET(i, &allowed);
+      }
+   }
+   for(node = 0; node < MAX_NODES; node++){
+      snprintf(path, sizeof(path), "/sys/devices/system/node/node%d/cpulist", node);
+      file = fopen(path, "r");
+      if(file == NULL){
+         continue;
+      }
+      node_count[topology->nodes] = fgets(list, sizeof(list), file)
+         ? parseCpuList(list, &allowed, node_cpus[topology->nodes], MAX_WORKERS) : 0;
+      fclose(file);
+      if(node_count[topology->nodes] > 0){
+         topology->node_id[topology->nodes++] = node;
+      }
+   }
+   if(topology->nodes == 0){
+      topology->nodes = 1;
+      node_count[0] = 0;
+      for(i = 0; i < CPU_SETSIZE && node_count[0] < MAX_WORKERS; i++){
+         if(CPU_ISSET(i, &allowed)){
+            node_cpus[0][node_count[0]++] = i;
+         }
+      }
+   }
+
+   // Interleaved across nodes, so the first few workers spread over sockets
+   for(round = 0; topology->cpus < MAX_WORKERS; round++){
+      found = FALSE;
+      for(node = 0; node < topology->nodes && topology->cpus < MAX_WORKERS; node++){
+         if(round < node_count[node]){
+            topology->cpu[topology->cpus] = node_cpus[node][round];
+            topology->cpu_node[topology->cpus++] = node;
+            found = TRUE;
+         }
+      }
+      if(found == FALSE){
+         break;
+      }
+   }
+   if(topology->cpus == 0){
+      topology->cpu[0] = -1;
+      topology->cpu_node[0] = 0;
+      topology->cpus = 1;
+   }
+}
+
+// Zeroed anonymous memory placed on first touch, interleaved over every node
+// or preferring one node of the topology. Transparent huge pages are a hint;
+// explicit ones come from the reserved pool and fail when it is empty.
+// Returns NULL on failure.
+void *nebPlacedAlloc(size_t bytes, const memory_topology *topology, int node, int huge_pages){
+   size_t length = placedLength(bytes, huge_pages);
+   int flags = MAP_PRIVATE | MAP_ANONYMOUS | (huge_pages == NEBULA_HUGE_PAGES_EXPLICIT ? MAP_HUGETLB : 0);
+   void *memory = mmap(NULL, length, PROT_READ | PROT_WRITE, flags, -1, 0);
+
+   if(memory == MAP_FAILED){
+      return NULL;
+   }
+   if(huge_pages == NEBULA_HUGE_PAGES_TRANSPARENT){
+      madvise(memory, length, MADV_HUGEPAGE);
+   }
+
+   // Before the first touch, so every page is placed by the policy
+   if(topology->nodes > 1 && node != PLACE_FIRST_TOUCH){
+      bindMemory(memory, length, node == PLACE_INTERLEAVE ? MPOL_INTERLEAVE : MPOL_PREFERRED, topology, node);
+   }
+   return memory;
+}
+
+void nebPlacedFree(void *memory, size_t bytes, int huge_pages){
+   if(memory != NULL){
+      munmap(memory, placedLength(bytes, huge_pages));
+   }
+}
+
+// Thread attributes pinning a new thread to one CPU, or leaving it free
+// when cpu is -1. Pinned from the start, its first touches land nearby.
+void nebPinnedAttributes(pthread_attr_t *attributes, int cpu){
+   cpu_set_t set;
+
+   pthread_attr_init(attributes);
+   if(cpu >= 0){
+      CPU_ZERO(&set);
+      CPU_SET(cpu, &set);
+      pthread_attr_setaffinity_np(attributes, sizeof(set), &set);
+   }
+}
+
+long long *nebulaAllocHistogram(const nebula_params *params){
+   memory_topology topology;
+
+   nebMemoryTopology(&topology);
+   return nebPlacedAlloc(nebulaHistogramLength(params) * sizeof(long long), &topology,
+      params->placement == NEBULA_PLACEMENT_FIRST_TOUCH ? PLACE_FIRST_TOUCH : PLACE_INTERLEAVE,
+      params->huge_pages);
+}
+
+void nebulaFreeHistogram(long long *histogram, const nebula_params *params){
+   nebPlacedFree(histogram, nebulaHistogramLength(params) * sizeof(long long), params->huge_pages);
+}
+
+size_t nebulaContextMemory(const nebula_params *params){
+   memory_topology topology;
+   size_t bytes = sizeof(nebula_context);
+
+   if(params->placement == NEBULA_PLACEMENT_REPLICATE){
+      nebMemoryTopology(&topology);
+      bytes += topology.nodes * placedLength(nebulaHistogramLength(params) * sizeof(long long),
+         params->huge_pages);
+   }
+   return bytes;
+}
+
+// "0-3,8,10-11" as in sysfs, keeping up to capacity of the allowed CPUs
+static int parseCpuList(const char *list, const cpu_set_t *allowed, int *cpus, int capacity){
+   int count = 0, first, last, cpu;
+   char *end;
+
+   while(*list != '\0' && *list != '\n'){
+      first = last = strtol(list, &end, 10);
+      if(end == list){
+         break;
+      }
+      if(*end == '-'){
+         list = end + 1;
+         last = strtol(list, &end, 10);
+      }
+      for(cpu = first; cpu <= last && count < capacity; cpu++){
+         if(cpu >= 0 && cpu < CPU_SETSIZE && CPU_ISSET(cpu, allowed)){
+            cpus[count++] = cpu;
+         }
+      }
+      list = *end == ',' ? end + 1 : end;
+   }
+   return count;
+}
+
+// Interleaves over every node of the topology, or prefers just one
+static int bindMemory(void *memory, size_t bytes, int mode, const memory_topology *topology, int node){
+   unsigned long mask = 0;
+   int i;
+
+   if(node == PLACE_INTERLEAVE){
+      for(i = 0; i < topology->nodes; i++){
+         mask |= 1UL << topology->node_id[i];
+      }
+   } else {
+      mask = 1UL << topology->node_id[node];
+   }
+   return syscall(SYS_mbind, memory, bytes, mode, &mask, (unsigned long)MAX_NODES + 1, 0) == 0;
+}
+
+static size_t placedLength(size_t bytes, int huge_pages){
+   if(huge_pages == NEBULA_HUGE_PAGES_EXPLICIT){
+      return (bytes + HUGE_PAGE_BYTES - 1) / HUGE_PAGE_BYTES * HUGE_PAGE_BYTES;
+   }
+   return bytes;
+}
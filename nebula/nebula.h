@@ -0,0 +1,277 @@
+/*************************************************/
+/*              NebulaBrot Renderer              */
+/*************************************************/
+
+// Reentrant library behind buddahbrot, nebulabrot and nebulabrot_old.
+// A render context samples orbits into a histogram owned by the caller,
+// and the tone mapping and output stages work on caller buffers, so any
+// number of contexts can run side by side in one process.
+//
+//    nebula_params params;
+//    nebulaDefaultParams(&params);
+//    long long *histogram = calloc(nebulaHistogramLength(&params), sizeof(long long));
+//    unsigned char *pixels = malloc(nebulaImageSize(&params));
+//    nebula_context *context = nebulaCreate(&params, histogram);
+//    nebulaSample(context);
+//    nebulaToneMap(histogram, params.width, params.height, pixels);
+//    nebulaDestroy(context);
+
+#ifndef NEBULA_H
+#define NEBULA_H
+
+#include <stddef.h>
+
+// Hit counts per pixel, red, green and blue
+#define NEBULA_CHANNELS 3
+
+// Bytes per tone mapped pixel, red, green and blue
+#define NEBULA_RGB 3
+
+// Regions of the c-plane skipped before iterating
+#define NEBULA_EXCLUDE_NONE 0
+#define NEBULA_EXCLUDE_CARDIOID 1   // Main cardioid and period 2 bulb
+#define NEBULA_EXCLUDE_BOXES 2      // Boxes inside the set
+#define NEBULA_EXCLUDE_ALL (NEBULA_EXCLUDE_CARDIOID | NEBULA_EXCLUDE_BOXES)
+
+// How c is drawn from the sampling square
+#define NEBULA_SAMPLER_UNIFORM 0      // Independent uniform draws
+#define NEBULA_SAMPLER_HALTON 1       // Halton (2, 3) with random digit scrambling
+#define NEBULA_SAMPLER_SOBOL 2        // Sobol with linear matrix scrambling and digital shift
+#define NEBULA_SAMPLER_STRATIFIED 3   // One jittered point per stratum, strata visited in a scattered order
+
+// Where the histogram's pages live on machines with several NUMA nodes
+#define NEBULA_PLACEMENT_FIRST_TOUCH 0   // Wherever the first writer runs
+#define NEBULA_PLACEMENT_INTERLEAVE 1    // Spread page by page over every node
+#define NEBULA_PLACEMENT_REPLICATE 2     // A replica per node, merged at every sync
+
+// Pages backing the histogram and its replicas
+#define NEBULA_HUGE_PAGES_NONE 0
+#define NEBULA_HUGE_PAGES_TRANSPARENT 1  // madvise hint to the kernel
+#define NEBULA_HUGE_PAGES_EXPLICIT 2     // Reserved hugetlb pages, fails without them
+
+// Per job parameters. Orbits escaping strictly between the min and max
+// orbital length are traced, and counted in each channel whose window
+// strictly contains their length.
+typedef struct _nebula_params {
+   int width;                    // Image dimensions in pixels
+   int height;
+   int min_orbital_length;
+   int max_orbital_length;
+   int channel_min[NEBULA_CHANNELS];
+   int channel_max[NEBULA_CHANNELS];
+   int exclusions;               // NEBULA_EXCLUDE_*
+   long max_samples;             // Accepted orbits to trace, 0 for no limit
+   int sampler;                  // NEBULA_SAMPLER_*
+   double target_error;          // Stop below this estimated relative error, 0 to disable
+   double time_budget;           // Stop after this many seconds, 0 to disable
+   int importance;               // Importance sample c from an escape-time prepass
+   int cascade;                  // Rule draws out in double precision before long double
+   int threads;                  // Worker threads, 0 for one per core
+   int placement;                // NEBULA_PLACEMENT_*
+   int huge_pages;               // NEBULA_HUGE_PAGES_*
+   int pin_threads;              // Pin workers to CPUs, spread over the nodes
+   unsigned long long seed;      // 0 to seed from the clock
+   int verbose;                  // Print progress to stdout
+} nebula_params;
+
+// Log2 buckets of the survey's orbit length distribution
+#define NEBULA_SURVEY_BUCKETS 32
+
+// What nebulaSurvey() found out about a job before running it
+typedef struct _nebula_survey {
+   long probes;                  // Points tested, one per stratum of the sampling square
+   long excluded;                // Skipped by the exclusions
+   long bounded;                 // Still bounded after max_orbital_length iterations
+   long accepted;                // Inside the orbital window
+   long long lengths[NEBULA_SURVEY_BUCKETS];   // Escapes after [2^k, 2^(k+1)) iterations
+   double acceptance;            // Fraction of uniform draws accepted
+   double acceptance_error;      // Its standard error, or a 95% upper bound if none were accepted
+   double channel_acceptance[NEBULA_CHANNELS];   // Fraction accepted and counted in each channel
+   double splats_per_orbit;      // Points splatted per accepted orbit
+   double adds_per_orbit;        // Histogram adds per accepted orbit, over the channels
+   double probe_seconds;         // Search time per point drawn, one core, the job's kernel
+   double orbit_seconds;         // Trace time per accepted orbit, one core, -1 if none accepted
+   double projected_seconds;     // Wall clock for max_samples uniform samples, -1 if unknown
+   int threads;                  // Workers the projection assumes
+   double seconds;               // Time the survey took
+} nebula_survey;
+
+// What nebulaCheckCascade() found comparing the search with and without it
+typedef struct _nebula_cascade_check {
+   long draws;                   // Points drawn, the same for both searches
+   long promoted;                // Left by the double precision pass for long double
+   long reference_accepted;      // Accepted by the long double search alone
+   long accepted;                // Accepted with the cascade
+   long missed;                  // Accepted without the cascade only
+   double reference_seconds;     // Search time without the cascade, one core
+   double cascade_seconds;       // Search time with it
+   double pixel_agreement;       // Fraction of pixels equal in every channel
+   double hit_difference;        // Sum of the hit differences over the reference's hits
+} nebula_cascade_check;
+
+// How a context's last nebulaSample() went
+typedef struct _nebula_stats {
+   const char *kernel;           // Specialized kernel used, or "generic"
+   long samples;                 // Accepted orbits traced
+   double seconds;
+   const char *stop_reason;      // "samples", "target", "budget", "stopped" or "survivors"
+   double estimated_error[NEBULA_CHANNELS];   // -1 where not estimated
+   double importance_coverage;   // Fraction of the square favoured by importance sampling
+   long long hit_weight;         // Histogram increment of one uniform hit
+   long long survivors;          // Orbits in the survivors table being kept
+} nebula_stats;
+
+// Part of a histogram to tone map and how. Each output pixel averages a
+// scale x scale box of the crop, rows come out in histogram order.
+typedef struct _nebula_view {
+   int x;                        // Crop in histogram pixels
+   int y;
+   int width;
+   int height;
+   int scale;                    // Downscale factor, 1 for full resolution
+   double gamma;                 // Curve exponent, 1/3 is the cube root map
+   double exposure;              // Multiplies counts relative to the brightest pixel
+} nebula_view;
+
+typedef struct _nebula_context nebula_context;
+
+// Defaults are the buddahbrot job
+void nebulaDefaultParams(nebula_params *params);
+int nebulaValidParams(const nebula_params *params);
+
+// Elements of the histogram, (y * width + x) * NEBULA_CHANNELS + channel
+size_t nebulaHistogramLength(const nebula_params *params);
+
+// Histogram placed and backed as the parameters ask, zeroed, for
+// nebulaCreate(). NULL if it can't be allocated. Free with
+// nebulaFreeHistogram() and the same parameters.
+long long *nebulaAllocHistogram(const nebula_params *params);
+void nebulaFreeHistogram(long long *histogram, const nebula_params *params);
+
+// Bytes nebulaCreate() allocates for a context, replicas included
+size_t nebulaContextMemory(const nebula_params *params);
+
+// Bytes of the tone mapped image, (y * width + x) * NEBULA_RGB + channel
+size_t nebulaImageSize(const nebula_params *params);
+
+// The histogram must outlive the context, hits are added to what it holds.
+// Returns NULL if the parameters are invalid or memory runs out.
+nebula_context *nebulaCreate(const nebula_params *params, long long *histogram);
+void nebulaDestroy(nebula_context *context);
+
+// Samples until a stopping condition is met. Returns 0 on failure.
+// With NEBULA_PLACEMENT_REPLICATE the histogram only catches up with the
+// replicas at convergence checkpoints and when the run ends.
+int nebulaSample(nebula_context *context);
+
+// Ends a running nebulaSample() early, or the next one if none is running,
+// safe from any thread
+void nebulaStop(nebula_context *context);
+
+// Limits of the following nebulaSample() calls, as in nebula_params, with
+// both 0 a run goes on until nebulaStop(). The first call times the two
+// stages to split the workers between them and scrambles the low-discrepancy
+// sequences, the following ones keep that split and carry the sequences on,
+// so short repeated runs start at once and extend one point set.
+void nebulaSetLimits(nebula_context *context, long max_samples, double time_budget);
+
+// Accepted orbits traced so far, safe while sampling
+long nebulaSamples(const nebula_context *context);
+
+// Copies the histogram, replicas included, safe while sampling. The copy
+// holds at least the orbits of the returned count, which is nebulaSamples()
+// when the copy began, and possibly part of the ones being traced.
+long nebulaCopyHistogram(nebula_context *context, long long *copy);
+
+void nebulaStats(const nebula_context *context, nebula_stats *stats);
+
+// Histogram increment of one uniform hit for a job, IMPORTANCE weighted
+// hits count for more
+long long nebulaHitWeight(const nebula_params *params);
+
+// Survivors tables, described in survivor.c. Orbits the following runs
+// draw that outlast the orbital window are kept in a new table, with where
+// they stopped. A resumed table replaces drawing: runs carry its orbits on
+// to their own cap, trace those now in the window and keep the rest in the
+// kept table, which must be another file. A run stopping early leaves the
+// rest of the table to the next run, or copies it to the kept table. The
+// run ends with "survivors" once the table is done. Between runs only,
+// each returns 0 if the file can't be written or read.
+int nebulaKeepSurvivors(nebula_context *context, const char *filename);
+int nebulaResumeSurvivors(nebula_context *context, const char *filename);
+
+// Runs the escape test on about probes stratified points and times the
+// job's kernels, without touching a histogram. Returns 0 on invalid params.
+int nebulaSurvey(const nebula_params *params, long probes, nebula_survey *survey);
+
+// Searches the same draws with and without the cascade on one thread,
+// traces what each accepts into a histogram of its own and compares the
+// two. Returns 0 on invalid params or if memory runs out.
+int nebulaCheckCascade(const nebula_params *params, long draws, nebula_cascade_check *check);
+
+// Cube root tone map of each channel against its brightest pixel
+void nebulaToneMap(const long long *histogram, int width, int height, unsigned char *pixels);
+
+// Brightest count of each channel
+void nebulaHistogramMax(const long long *histogram, int width, int height, long long *channel_max);
+
+// The whole frame at full resolution with the cube root map
+void nebulaDefaultView(int width, int height, nebula_view *view);
+
+// Bytes nebulaToneMapView() writes, 0 if the view doesn't fit the histogram
+size_t nebulaViewSize(const nebula_view *view, int width, int height);
+
+// Tone maps a view against the brightest count of the whole frame, so crops
+// match the full image. channel_max may be NULL to scan for it. Returns 0 if
+// the view doesn't fit the histogram.
+int nebulaToneMapView(const long long *histogram, int width, int height,
+   const long long *channel_max, const nebula_view *view, unsigned char *pixels);
+
+// Output stages, each returns 0 on failure
+int nebulaWriteBmp(const char *filename, int width, int height, const unsigned char *pixels);
+int nebulaWriteMetadata(const char *filename, const char *image,
+   const nebula_params *params, const nebula_stats *stats);
+
+// PNG of the cube root tone map with 8 or 16 bit samples. Bands of rows are
+// tone mapped and deflated in parallel, threads is 0 for one per core.
+int nebulaWritePng(const char *filename, const long long *histogram, int width, int height,
+   int depth, int threads);
+
+// PNG of already tone mapped pixels, top row first, on the calling thread
+int nebulaWritePngPixels(const char *filename, int width, int height, const unsigned char *pixels);
+
+// Deep zoom pyramid of the cube root tone map: name.dzi, and tile_size
+// tiles of each power-of-two level under name_files/LEVEL/COLUMN_ROW.png.
+// Memory stays at a couple of rows of tiles. threads is 0 for one per core.
+int nebulaWritePyramid(const char *name, const long long *histogram, int width, int height,
+   int tile_size, int threads);
+
+// Incremental export of a histogram that is still being sampled, for
+// shards feeding one aggregate. The first delta holds what the histogram
+// gained after nebulaDeltaCreate(), each later one what it gained since the
+// last. The format is described in delta.c. hit_weight is the histogram's
+// increment per uniform hit, nebulaHitWeight(), recorded so that counts of
+// another scale are never added together.
+typedef struct _nebula_delta nebula_delta;
+nebula_delta *nebulaDeltaCreate(const long long *histogram, int width, int height, long long hit_weight);
+void nebulaDeltaDestroy(nebula_delta *delta);
+
+// Writes a delta carrying the given count of new samples, safe while
+// sampling. Returns its size in bytes, -1 on failure.
+long nebulaExportDelta(nebula_delta *delta, const char *filename, long long samples);
+
+// Adds a delta to a histogram file, created if missing. Returns 0 on failure,
+// which includes a file of another size or hit weight.
+int nebulaApplyDelta(const char *histogram_file, const char *delta_file);
+
+// Adds a whole histogram and its sample count to a histogram file, created
+// if missing. Returns 0 on failure, as for nebulaApplyDelta().
+int nebulaAddHistogram(const char *histogram_file, const long long *histogram, int width, int height,
+   long long samples, long long hit_weight);
+
+// Reads a histogram file, NULL on failure. The caller frees the histogram.
+long long *nebulaLoadHistogram(const char *filename, int *width, int *height, long long *samples);
+
+const char *nebulaSamplerName(int sampler);
+
+#endif
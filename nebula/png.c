@@ -0,0 +1,305 @@
+/*************************************************/
+/*               NebulaBrot PNG Output           */
+/*************************************************/
+
+// PNG encoder that splits the image into bands of rows, each tone mapped,
+// filtered and deflated on its own by whichever worker claims it. Bands end
+// on a sync flush, so their streams concatenate into one zlib stream, and
+// their Adler-32 sums are combined in order as the bands are written out.
+// Tone mapping a band and deflating it happen on the same core, so the
+// tone map of one band overlaps the compression of the others.
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <math.h>
+#include <zlib.h>
+
+#include "internal.h"
+
+// Rows per independently compressed band, and the deflate level
+#define PNG_BAND_ROWS 32
+#define PNG_LEVEL 6
+
+typedef struct _png_band {
+   unsigned char *data;          // Raw deflate output, NULL until done
+   size_t size;
+   unsigned long adler;          // Adler-32 of the filtered rows
+   size_t raw_size;
+   int done;
+} png_band;
+
+typedef struct _png_encoder png_encoder;
+struct _png_encoder {
+   int width;
+   int height;
+   int depth;                    // Bits per sample, 8 or 16
+   int bands;
+
+   // Fills row y, counted from the top, with big endian RGB samples
+   void (*row)(const png_encoder *encoder, int y, unsigned char *samples);
+   const long long *histogram;
+   long long channel_max[CHANNELS];
+   const unsigned char *pixels;
+
+   atomic_int next_band;
+   png_band *band;
+   pthread_mutex_t lock;
+   pthread_cond_t finished;
+};
+
+typedef struct _png_worker {
+   pthread_t thread;
+   png_encoder *encoder;
+} png_worker;
+
+static int encodePng(const char *filename, png_encoder *encoder, int threads);
+static void *pngWorker(void *arg);
+static int encodeBand(png_encoder *encoder, int index);
+static void histogramRow(const png_encoder *encoder, int y, unsigned char *samples);
+static void pixelRow(const png_encoder *encoder, int y, unsigned char *samples);
+static void writeChunk(FILE *file, const char *type, const unsigned char *data, size_t size,
+   const unsigned char *tail, size_t tail_size);
+static void putBigEndian(unsigned char *out, unsigned long value);
+
+
+int nebulaWritePng(const char *filename, const long long *histogram, int width, int height,
+      int depth, int threads){
+   png_encoder encoder;
+
+   if(depth != 8 && depth != 16){
+      return FALSE;
+   }
+   memset(&encoder, 0, sizeof(encoder));
+   encoder.width = width;
+   encoder.height = height;
+   encoder.depth = depth;
+   encoder.row = histogramRow;
+   encoder.histogram = histogram;
+   nebulaHistogramMax(histogram, width, height, encoder.channel_max);
+   return encodePng(filename, &encoder, nebWorkerCount(threads));
+}
+
+int nebulaWritePngPixels(const char *filename, int width, int height, const unsigned char *pixels){
+   png_encoder encoder;
+
+   memset(&encoder, 0, sizeof(encoder));
+   encoder.width = width;
+   encoder.height = height;
+   encoder.depth = 8;
+   encoder.row = pixelRow;
+   encoder.pixels = pixels;
+   return encodePng(filename, &encoder, 1);
+}
+
+// Writes the file as bands finish, in order, while the workers keep going
+static int encodePng(const char *filename, png_encoder *encoder, int threads){
+   static const unsigned char signature[8] = {0x89, 'P', 'N', 'G', '\r', '\n', 0x1A, '\n'};
+   static const unsigned char zlib_header[2] = {0x78, 0x9C};
+   png_worker workers[MAX_WORKERS];
+   unsigned char header[13], adler_bytes[4];
+   unsigned long adler = adler32(0, NULL, 0);
+   FILE *file = fopen(filename, "wb");
+   int i, started = 0, failed = file == NULL;
+
+   encoder->bands = (encoder->height + PNG_BAND_ROWS - 1) / PNG_BAND_ROWS;
+   encoder->band = calloc(encoder->bands, sizeof(png_band));
+   if(encoder->band == NULL || failed){
+      if(file != NULL){
+         fclose(file);
+      }
+      free(encoder->band);
+      return FALSE;
+   }
+   atomic_init(&encoder->next_band, 0);
+   pthread_mutex_init(&encoder->lock, NULL);
+   pthread_cond_init(&encoder->finished, NULL);
+   if(threads > encoder->bands){
+      threads = encoder->bands;
+   }
+
+   putBigEndian(header, encoder->width);
+   putBigEndian(header + 4, encoder->height);
+   header[8] = encoder->depth;
+   header[9] = 2;      // Truecolour
+   header[10] = 0;     // Deflate
+   header[11] = 0;     // Adaptive filtering
+   header[12] = 0;     // Not interlaced
+   fwrite(signature, sizeof(signature), 1, file);
+   writeChunk(file, "IHDR", header, sizeof(header), NULL, 0);
+
+   // A single thread, or one whose workers couldn't be started, encodes the
+   // bands itself as they are written
+   for(i = 0; i < threads && threads > 1; i++){
+      workers[i].encoder = encoder;
+      if(pthread_create(&workers[i].thread, NULL, pngWorker, &workers[i]) != 0){
+         break;
+      }
+      started++;
+   }
+   for(i = 0; i < encoder->bands; i++){
+      png_band *band = &encoder->band[i];
+      if(started == 0){
+         encodeBand(encoder, i);
+      }
+      pthread_mutex_lock(&encoder->lock);
+      while(band->done == FALSE){
+         pthread_cond_wait(&encoder->finished, &encoder->lock);
+      }
+      pthread_mutex_unlock(&encoder->lock);
+
+      failed = failed || band->data == NULL;
+      if(failed == FALSE){
+         adler = adler32_combine(adler, band->adler, band->raw_size);
+         putBigEndian(adler_bytes, adler);
+         if(i == 0){
+            writeChunk(file, "IDAT", zlib_header, sizeof(zlib_header), band->data, band->size);
+         } else {
+            writeChunk(file, "IDAT", band->data, band->size, NULL, 0);
+         }
+         if(i == encoder->bands - 1){
+            writeChunk(file, "IDAT", adler_bytes, sizeof(adler_bytes), NULL, 0);
+         }
+      }
+      free(band->data);
+      band->data = NULL;
+   }
+   for(i = 0; i < started; i++){
+      pthread_join(workers[i].thread, NULL);
+   }
+   writeChunk(file, "IEND", NULL, 0, NULL, 0);
+
+   failed = fclose(file) != 0 || failed;
+   pthread_mutex_destroy(&encoder->lock);
+   pthread_cond_destroy(&encoder->finished);
+   free(encoder->band);
+   return failed == FALSE;
+}
+
+static void *pngWorker(void *arg){
+   png_worker *self = arg;
+   png_encoder *encoder = self->encoder;
+   int index;
+
+   while((index = atomic_fetch_add(&encoder->next_band, 1)) < encoder->bands){
+      encodeBand(encoder, index);
+   }
+   return NULL;
+}
+
+// Tone maps, filters and deflates one band. Rows use the Sub filter so a
+// band never needs the row above it.
+static int encodeBand(png_encoder *encoder, int index){
+   png_band *band = &encoder->band[index];
+   int first = index * PNG_BAND_ROWS;
+   int rows = encoder->height - first < PNG_BAND_ROWS ? encoder->height - first : PNG_BAND_ROWS;
+   int pixel_bytes = RGB * encoder->depth / 8;
+   size_t row_bytes = 1 + (size_t)encoder->width * pixel_bytes, i;
+   unsigned char *raw = malloc(rows * row_bytes), *line;
+   unsigned char *data = NULL;
+   z_stream stream;
+   int y, finished;
+
+   if(raw != NULL){
+      for(y = 0; y < rows; y++){
+         line = raw + y * row_bytes;
+         line[0] = 1;
+         encoder->row(encoder, first + y, line + 1);
+         for(i = row_bytes - 1; i > (size_t)pixel_bytes; i--){
+            line[i] -= line[i - pixel_bytes];
+         }
+      }
+      band->raw_size = rows * row_bytes;
+      band->adler = adler32(adler32(0, NULL, 0), raw, band->raw_size);
+
+      memset(&stream, 0, sizeof(stream));
+      if(deflateInit2(&stream, PNG_LEVEL, Z_DEFLATED, -15, 8, Z_FILTERED) == Z_OK){
+         band->size = deflateBound(&stream, band->raw_size) + 16;
+         data = malloc(band->size);
+         stream.next_in = raw;
+         stream.avail_in = band->raw_size;
+         stream.next_out = data;
+         stream.avail_out = band->size;
+         // The last band must end the stream. A sync flush that filled the
+         // buffer may not have written all of its output, so room must be left.
+         if(data == NULL){
+            finished = FALSE;
+         } else if(index == encoder->bands - 1){
+            finished = deflate(&stream, Z_FINISH) == Z_STREAM_END;
+         } else {
+            finished = deflate(&stream, Z_SYNC_FLUSH) == Z_OK && stream.avail_in == 0 && stream.avail_out > 0;
+         }
+         if(finished){
+            band->size -= stream.avail_out;
+         } else {
+            free(data);
+            data = NULL;
+         }
+         deflateEnd(&stream);
+      }
+      free(raw);
+   }
+
+   pthread_mutex_lock(&encoder->lock);
+   band->data = data;
+   band->done = TRUE;
+   pthread_cond_broadcast(&encoder->finished);
+   pthread_mutex_unlock(&encoder->lock);
+   return data != NULL;
+}
+
+// Cube root map as in nebulaToneMap(). Rows run top down as in the BMP,
+// which puts histogram row 0 at the bottom.
+static void histogramRow(const png_encoder *encoder, int y, unsigned char *samples){
+   const long long *row = encoder->histogram + (size_t)(encoder->height - 1 - y) * encoder->width * CHANNELS;
+   double top[CHANNELS];
+   int x, channel, value;
+
+   for(channel = 0; channel < CHANNELS; channel++){
+      top[channel] = cbrt(encoder->channel_max[channel]);
+   }
+   for(x = 0; x < encoder->width * CHANNELS; x += CHANNELS){
+      for(channel = 0; channel < CHANNELS; channel++){
+         if(encoder->depth == 8){
+            *samples++ = top[channel] > 0 ? (unsigned char)(255*cbrt(row[x + channel])/top[channel]) : 0;
+         } else {
+            value = top[channel] > 0 ? 65535*cbrt(row[x + channel])/top[channel] : 0;
+            *samples++ = value >> 8;
+            *samples++ = value & 0xFF;
+         }
+      }
+   }
+}
+
+// Tone mapped pixels, row 0 first
+static void pixelRow(const png_encoder *encoder, int y, unsigned char *samples){
+   memcpy(samples, encoder->pixels + (size_t)y * encoder->width * RGB, (size_t)encoder->width * RGB);
+}
+
+// Length, type, data and CRC. The tail is written as part of the data.
+static void writeChunk(FILE *file, const char *type, const unsigned char *data, size_t size,
+      const unsigned char *tail, size_t tail_size){
+   unsigned char bytes[4];
+   unsigned long crc = crc32(0, (const unsigned char *)type, 4);
+
+   putBigEndian(bytes, size + tail_size);
+   fwrite(bytes, 4, 1, file);
+   fwrite(type, 4, 1, file);
+   if(size > 0){
+      fwrite(data, size, 1, file);
+      crc = crc32(crc, data, size);
+   }
+   if(tail_size > 0){
+      fwrite(tail, tail_size, 1, file);
+      crc = crc32(crc, tail, tail_size);
+   }
+   putBigEndian(bytes, crc);
+   fwrite(bytes, 4, 1, file);
+}
+
+static void putBigEndian(unsigned char *out, unsigned long value){
+   out[0] = value >> 24;
+   out[1] = value >> 16;
+   out[2] = value >> 8;
+   out[3] = value;
+}
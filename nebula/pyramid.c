@@ -0,0 +1,229 @@
+/*************************************************/
+/*            NebulaBrot Tile Pyramid            */
+/*************************************************/
+
+// Deep zoom output: the frame is tone mapped once, a band of tile rows at a
+// time from the top, and each band is cut into tiles and halved into the
+// band of the level below while it is still in cache. Every level holds a
+// single band, so memory is about two rows of full resolution tiles.
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <sys/stat.h>
+
+#include "internal.h"
+
+#define PATH_LENGTH 4096
+
+typedef struct _pyramid_level {
+   int level;                    // Deep zoom level number, 0 is 1x1
+   int width;
+   int height;
+   int band_row;                 // First row of the band, in level pixels from the top
+   int rows;                     // Rows of the band filled so far
+   unsigned char *band;          // tile_size rows, top row first
+} pyramid_level;
+
+typedef struct _pyramid {
+   const char *name;
+   int tile_size;
+   int threads;
+   int levels;
+   int failed;
+   pyramid_level *level;
+} pyramid;
+
+// Columns of a band's tiles written by the tile workers
+typedef struct _tile_worker {
+   pthread_t thread;
+   int started;
+   pyramid *pyramid;
+   pyramid_level *level;
+   atomic_int *next_column;
+   int failed;
+} tile_worker;
+
+static int pushRows(pyramid *pyramid, int index, const unsigned char *rows, int count);
+static int flushBand(pyramid *pyramid, int index);
+static void *tileWorker(void *arg);
+static int writeTile(const pyramid *pyramid, const pyramid_level *level, int column, unsigned char *tile);
+static int makeDirectory(const char *path);
+
+
+int nebulaWritePyramid(const char *name, const long long *histogram, int width, int height,
+      int tile_size, int threads){
+   pyramid pyramid = {name, tile_size, nebWorkerCount(threads), 1, FALSE, NULL};
+   long long channel_max[CHANNELS];
+   unsigned char *row;
+   nebula_view view;
+   char path[PATH_LENGTH];
+   FILE *file;
+   int index, y, size;
+
+   if(tile_size < 2 || tile_size % 2 != 0 || width < 1 || height < 1){
+      return FALSE;
+   }
+   for(size = width > height ? width : height; size > 1; size = (size + 1) / 2){
+      pyramid.levels++;
+   }
+   pyramid.level = calloc(pyramid.levels, sizeof(pyramid_level));
+   row = malloc((size_t)width * RGB);
+   snprintf(path, sizeof(path), "%s_files", name);
+   if(pyramid.level == NULL || row == NULL || makeDirectory(path) == FALSE){
+      free(pyramid.level);
+      free(row);
+      return FALSE;
+   }
+   for(index = pyramid.levels - 1; index >= 0; index--){
+      pyramid_level *level = &pyramid.level[index];
+      level->level = index;
+      level->width = index == pyramid.levels - 1 ? width : (pyramid.level[index + 1].width + 1) / 2;
+      level->height = index == pyramid.levels - 1 ? height : (pyramid.level[index + 1].height + 1) / 2;
+      level->band = malloc((size_t)level->width * tile_size * RGB);
+      snprintf(path, sizeof(path), "%s_files/%d", name, index);
+      if(level->band == NULL || makeDirectory(path) == FALSE){
+         pyramid.failed = TRUE;
+      }
+   }
+
+   // Rows run top down as in the BMP, which puts histogram row 0 at the bottom
+   nebulaHistogramMax(histogram, width, height, channel_max);
+   nebulaDefaultView(width, height, &view);
+   view.height = 1;
+   for(y = 0; y < height && pyramid.failed == FALSE; y++){
+      view.y = height - 1 - y;
+      nebulaToneMapView(histogram, width, height, channel_max, &view, row);
+      pushRows(&pyramid, pyramid.levels - 1, row, 1);
+   }
+
+   snprintf(path, sizeof(path), "%s.dzi", name);
+   file = pyramid.failed ? NULL : fopen(path, "w");
+   if(file != NULL){
+      fprintf(file, "<?xml version=\"1.0\" encoding=\"UTF-8\"?>\n");
+      fprintf(file, "<Image xmlns=\"http://schemas.microsoft.com/deepzoom/2008\""
+         " TileSize=\"%d\" Overlap=\"0\" Format=\"png\">\n", tile_size);
+      fprintf(file, "  <Size Width=\"%d\" Height=\"%d\"/>\n", width, height);
+      fprintf(file, "</Image>\n");
+      fclose(file);
+   }
+
+   for(index = 0; index < pyramid.levels; index++){
+      free(pyramid.level[index].band);
+   }
+   free(pyramid.level);
+   free(row);
+   return file != NULL;
+}
+
+// Appends rows to a level's band, writing it out once it holds a row of
+// tiles or the last row of the level
+static int pushRows(pyramid *pyramid, int index, const unsigned char *rows, int count){
+   pyramid_level *level = &pyramid->level[index];
+   size_t stride = (size_t)level->width * RGB;
+
+   memcpy(level->band + level->rows * stride, rows, count * stride);
+   level->rows += count;
+   if(level->rows == pyramid->tile_size || level->band_row + level->rows == level->height){
+      return flushBand(pyramid, index);
+   }
+   return TRUE;
+}
+
+// Writes the tiles of a full band, then halves it into the level below.
+// Bands start on even rows, so row pairs never straddle two bands.
+static int flushBand(pyramid *pyramid, int index){
+   pyramid_level *level = &pyramid->level[index];
+   tile_worker workers[MAX_WORKERS];
+   atomic_int next_column;
+   unsigned char *half = NULL;
+   int columns = (level->width + pyramid->tile_size - 1) / pyramid->tile_size;
+   int threads = pyramid->threads < columns ? pyramid->threads : columns;
+   int i, x, y, channel, half_width;
+
+   atomic_init(&next_column, 0);
+   for(i = 0; i < threads; i++){
+      workers[i].pyramid = pyramid;
+      workers[i].level = level;
+      workers[i].next_column = &next_column;
+      workers[i].failed = FALSE;
+      workers[i].started = pthread_create(&workers[i].thread, NULL, tileWorker, &workers[i]) == 0;
+   }
+
+   // Columns left over by workers that couldn't be started are made here
+   for(i = 0; i < threads; i++){
+      if(workers[i].started == FALSE){
+         tileWorker(&workers[i]);
+      } else {
+         pthread_join(workers[i].thread, NULL);
+      }
+      pyramid->failed = pyramid->failed || workers[i].failed;
+   }
+
+   if(index > 0 && pyramid->failed == FALSE){
+      half_width = pyramid->level[index - 1].width;
+      half = malloc((size_t)half_width * RGB);
+      if(half == NULL){
+         pyramid->failed = TRUE;
+      }
+      for(y = 0; y < level->rows && half != NULL; y += 2){
+         const unsigned char *top = level->band + (size_t)y * level->width * RGB;
+         const unsigned char *bottom = y + 1 < level->rows ? top + (size_t)level->width * RGB : top;
+         for(x = 0; x < half_width; x++){
+            int left = 2 * x, right = 2 * x + 1 < level->width ? 2 * x + 1 : 2 * x;
+            for(channel = 0; channel < RGB; channel++){
+               half[x * RGB + channel] = (top[left * RGB + channel] + top[right * RGB + channel]
+                  + bottom[left * RGB + channel] + bottom[right * RGB + channel] + 2) / 4;
+            }
+         }
+         pushRows(pyramid, index - 1, half, 1);
+      }
+      free(half);
+   }
+
+   level->band_row += level->rows;
+   level->rows = 0;
+   return pyramid->failed == FALSE;
+}
+
+static void *tileWorker(void *arg){
+   tile_worker *self = arg;
+   int tile_size = self->pyramid->tile_size;
+   int columns = (self->level->width + tile_size - 1) / tile_size;
+   unsigned char *tile = malloc((size_t)tile_size * tile_size * RGB);
+   int column;
+
+   if(tile == NULL){
+      self->failed = TRUE;
+      return NULL;
+   }
+   while((column = atomic_fetch_add(self->next_column, 1)) < columns){
+      if(writeTile(self->pyramid, self->level, column, tile) == FALSE){
+         self->failed = TRUE;
+      }
+   }
+   free(tile);
+   return NULL;
+}
+
+// Cuts one tile out of the band
+static int writeTile(const pyramid *pyramid, const pyramid_level *level, int column, unsigned char *tile){
+   int tile_size = pyramid->tile_size;
+   int x = column * tile_size;
+   int width = level->width - x < tile_size ? level->width - x : tile_size;
+   int height = level->rows, y;
+   char path[PATH_LENGTH];
+
+   for(y = 0; y < height; y++){
+      memcpy(tile + (size_t)y * width * RGB,
+         level->band + ((size_t)y * level->width + x) * RGB, (size_t)width * RGB);
+   }
+   snprintf(path, sizeof(path), "%s_files/%d/%d_%d.png", pyramid->name, level->level,
+      column, level->band_row / tile_size);
+   return nebulaWritePngPixels(path, width, height, tile);
+}
+
+static int makeDirectory(const char *path){
+   return mkdir(path, 0755) == 0 || errno == EEXIST;
+}
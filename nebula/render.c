@@ -0,0 +1,609 @@
+/*************************************************/
+/*          NebulaBrot Render Pipeline           */
+/*************************************************/
+
+// Render contexts and the two stage search/splat pipeline that fills them
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdarg.h>
+#include <string.h>
+#include <time.h>
+#include <math.h>
+#include <stdint.h>
+#include <limits.h>
+#include <sched.h>
+#include <unistd.h>
+
+#include "internal.h"
+
+static void monitorConvergence(nebula_context *context, double start);
+static int checkpointError(nebula_context *context, long long *snapshot, long snapshot_samples,
+   long samples, double *error);
+static void stopSampling(nebula_context *context, const char *reason);
+static void syncReplicas(nebula_context *context);
+static int drawBatch(nebula_context *context, unsigned long long *seed, candidate *accepted);
+static int searchAndPush(nebula_context *context, unsigned long long *seed, long long *hit_counter);
+static int splatOne(nebula_context *context, long long *hit_counter);
+static int startWorker(worker *self, void *(*run)(void *));
+static void *searchWorker(void *arg);
+static void *splatWorker(void *arg);
+static void ringInit(candidate_ring *ring);
+static int ringPush(candidate_ring *ring, const candidate *value);
+static int ringPop(candidate_ring *ring, candidate *value);
+
+
+void nebulaDefaultParams(nebula_params *params){
+   int channel;
+
+   memset(params, 0, sizeof(*params));
+   params->width = WIDTH;
+   params->height = HEIGHT;
+   params->min_orbital_length = MIN_ORBITAL_LENGTH;
+   params->max_orbital_length = MAX_ORBITAL_LENGTH;
+   for(channel = 0; channel < CHANNELS; channel++){
+      params->channel_min[channel] = CHANNEL_MIN;
+      params->channel_max[channel] = CHANNEL_MAX;
+   }
+   params->exclusions = EXCLUDE_CARDIOID;
+   params->max_samples = MAX_SAMPLES;
+   params->sampler = SAMPLER_UNIFORM;
+   params->cascade = TRUE;
+}
+
+int nebulaValidParams(const nebula_params *params){
+   return params->width >= 4 && params->height >= 4
+      && params->min_orbital_length < params->max_orbital_length
+      && params->sampler >= SAMPLER_UNIFORM && params->sampler <= SAMPLER_STRATIFIED
+      && params->threads >= 0
+      && params->placement >= NEBULA_PLACEMENT_FIRST_TOUCH && params->placement <= NEBULA_PLACEMENT_REPLICATE
+      && params->huge_pages >= NEBULA_HUGE_PAGES_NONE && params->huge_pages <= NEBULA_HUGE_PAGES_EXPLICIT
+      && params->max_samples >= 0 && params->target_error >= 0 && params->time_budget >= 0
+      && (params->max_samples > 0 || params->target_error > 0 || params->time_budget > 0);
+}
+
+size_t nebulaHistogramLength(const nebula_params *params){
+   return (size_t)params->width * params->height * CHANNELS;
+}
+
+size_t nebulaImageSize(const nebula_params *params){
+   return (size_t)params->width * params->height * RGB;
+}
+
+nebula_context *nebulaCreate(const nebula_params *params, long long *histogram){
+   nebula_context *context;
+   int channel;
+
+   if(histogram == NULL || nebulaValidParams(params) == FALSE){
+      return NULL;
+   }
+   context = calloc(1, sizeof(nebula_context));
+   if(context == NULL){
+      return NULL;
+   }
+   context->params = *params;
+   context->kernel = nebSelectKernel(params);
+   context->hit_counter = histogram;
+   nebMemoryTopology(&context->topology);
+   if(params->placement == NEBULA_PLACEMENT_REPLICATE){
+      for(; context->replicas < context->topology.nodes; context->replicas++){
+         context->replica[context->replicas] = nebPlacedAlloc(nebulaHistogramLength(params) * sizeof(long long),
+            &context->topology, context->replicas, params->huge_pages);
+         if(context->replica[context->replicas] == NULL){
+            nebulaDestroy(context);
+            return NULL;
+         }
+      }
+   }
+   context->seed = params->seed ? params->seed
+      : ((unsigned long long)time(NULL) << 20 ^ (uintptr_t)context) | 1;
+   atomic_init(&context->stop_reason, "samples");
+   context->search_share = -1;
+   for(channel = 0; channel < CHANNELS; channel++){
+      context->estimated_error[channel] = -1;
+   }
+   return context;
+}
+
+void nebulaDestroy(nebula_context *context){
+   int i;
+
+   if(context == NULL){
+      return;
+   }
+   nebFreeImportanceMap(context);
+   nebCloseSurvivors(context);
+   for(i = 0; i < context->replicas; i++){
+      nebPlacedFree(context->replica[i], nebulaHistogramLength(&context->params) * sizeof(long long),
+         context->params.huge_pages);
+   }
+   free(context);
+}
+
+// Splits the render into a compute-bound search stage (nebOrbitalLength) and a
+// memory-bound splat stage (orbitTrace) joined by a bounded ring. The stage
+// sizes come from timing both stages on one thread before the first run's
+// pool starts, later runs keep them.
+int nebulaSample(nebula_context *context){
+   worker workers[MAX_WORKERS];
+   candidate calibration[SEARCH_BATCH];
+   render_params *params = &context->params;
+   const render_kernel *kernel = context->kernel;
+   double search_time = 0, trace_time = 0, start, calibration_end;
+   int cores, search_workers, splat_workers, accepted, channel, i, cpu, pinned, started;
+   unsigned long long seed = context->seed;
+   double render_start = nebWallClock();
+   long limit = params->max_samples > 0 ? params->max_samples : LONG_MAX;
+
+   ringInit(&context->ring);
+   if(context->sequence_ready == FALSE){
+      nebSequenceInit(context, &seed);
+      context->sequence_ready = TRUE;
+   }
+   if(params->importance && context->importance.size == 0 && context->survivors.input == NULL){
+      if(nebBuildImportanceMap(context) == FALSE){
+         return FALSE;
+      }
+   }
+   atomic_init(&context->samples_claimed, 0);
+   atomic_init(&context->samples_traced, 0);
+   atomic_init(&context->sample_limit, limit);
+   atomic_store(&context->stop_reason, "samples");
+   for(channel = 0; channel < CHANNELS; channel++){
+      context->estimated_error[channel] = -1;
+   }
+
+   // A stop asked for between runs ends this one
+   if(atomic_load(&context->stop_requested)){
+      stopSampling(context, "stopped");
+   }
+
+   // Calibration runs before the monitor, so it keeps to the budget itself
+   accepted = 0;
+   calibration_end = render_start + CALIBRATION_SECONDS;
+   if(params->time_budget > 0 && params->time_budget * CALIBRATION_SHARE < CALIBRATION_SECONDS){
+      calibration_end = render_start + params->time_budget * CALIBRATION_SHARE;
+   }
+   if(context->search_share < 0){
+      nebProgress(context, "Calibrating stages...\n");
+   }
+   while(context->search_share < 0 && accepted < CALIBRATION_SAMPLES && nebWallClock() < calibration_end
+         && accepted < atomic_load(&context->sample_limit) && nebSurvivorsLeft(context)){
+      start = nebWallClock();
+      int found = drawBatch(context, &seed, calibration);
+      search_time += nebWallClock() - start;
+
+      start = nebWallClock();
+      for(i = 0; i < found && accepted < atomic_load(&context->sample_limit); i++, accepted++){
+         kernel->orbitTrace(context, &calibration[i], context->hit_counter);
+      }
+      trace_time += nebWallClock() - start;
+      nebKeepUntraced(context, calibration + i, found - i);
+   }
+   atomic_store(&context->samples_claimed, accepted);
+   atomic_store(&context->samples_traced, accepted);
+   if(context->search_share < 0 && search_time + trace_time > 0){
+      context->search_share = search_time / (search_time + trace_time);
+   }
+
+   // A single worker searches alone and traces what it finds after every
+   // batch, so the histogram keeps up with the samples counted
+   cores = nebWorkerCount(params->threads);
+   search_workers = context->search_share >= 0 ? cores * context->search_share + 0.5 : 1;
+   if(search_workers > cores - 1){
+      search_workers = cores - 1;
+   }
+   if(search_workers < 1){
+      search_workers = 1;
+   }
+   splat_workers = cores - search_workers;
+   nebProgress(context, "Search share %.3f -> %d search, %d splat workers\n",
+      context->search_share, search_workers, splat_workers);
+
+   // Workers are dealt CPUs across the nodes in turn, and splat into the
+   // replica on their own node
+   pinned = params->pin_threads || context->replicas > 0;
+   nebProgress(context, "Searching for points...\n");
+   atomic_init(&context->searchers_running, search_workers);
+   for(started = 0; started < cores; started++){
+      cpu = started % context->topology.cpus;
+      workers[started].seed = (seed + started * 0x9E3779B97F4A7C15ULL) | 1;
+      workers[started].context = context;
+      workers[started].cpu = pinned ? context->topology.cpu[cpu] : -1;
+      workers[started].alone = splat_workers == 0;
+      workers[started].hit_counter = context->replicas > 0
+         ? context->replica[context->topology.cpu_node[cpu]] : context->hit_counter;
+      if(startWorker(&workers[started], started < search_workers ? searchWorker : splatWorker) == FALSE){
+         break;
+      }
+   }
+
+   // Searchers are started first, the run goes on with those that started
+   if(started < search_workers){
+      atomic_fetch_sub(&context->searchers_running, search_workers - started);
+   }
+   if(started < cores){
+      nebProgress(context, "Only %d of %d workers could be started\n", started, cores);
+   }
+   if(started == 0){
+      stopSampling(context, "stopped");
+      return FALSE;
+   }
+   if(params->target_error > 0 || params->time_budget > 0){
+      monitorConvergence(context, render_start);
+   }
+   for(i = 0; i < started; i++){
+      pthread_join(workers[i].thread, NULL);
+   }
+   while(splatOne(context, context->hit_counter) == TRUE);
+   syncReplicas(context);
+   if(nebSurvivorsLeft(context) == FALSE){
+      atomic_store(&context->stop_reason, "survivors");
+   }
+   context->render_seconds = nebWallClock() - render_start;
+   context->seed = nebRandomBits(&seed) | 1;
+   atomic_store(&context->stop_requested, FALSE);
+   return nebFinishSurvivors(context);
+}
+
+void nebulaSetLimits(nebula_context *context, long max_samples, double time_budget){
+   context->params.max_samples = max_samples;
+   context->params.time_budget = time_budget;
+}
+
+void nebulaStop(nebula_context *context){
+   atomic_store(&context->stop_requested, TRUE);
+   stopSampling(context, "stopped");
+}
+
+long nebulaSamples(const nebula_context *context){
+   return atomic_load(&context->samples_traced);
+}
+
+long nebulaCopyHistogram(nebula_context *context, long long *copy){
+   size_t cells = nebulaHistogramLength(&context->params), i;
+   long traced = nebulaSamples(context);
+
+   // Workers may be adding meanwhile, so every read is atomic
+   syncReplicas(context);
+   for(i = 0; i < cells; i++){
+      copy[i] = __atomic_load_n(&context->hit_counter[i], __ATOMIC_RELAXED);
+   }
+   return traced;
+}
+
+long long nebulaHitWeight(const nebula_params *params){
+   return params->importance ? IMPORTANCE_WEIGHT : 1;
+}
+
+void nebulaStats(const nebula_context *context, nebula_stats *stats){
+   int channel;
+
+   stats->kernel = context->kernel->name;
+   stats->samples = nebulaSamples(context);
+   stats->seconds = context->render_seconds;
+   stats->stop_reason = atomic_load(&context->stop_reason);
+   for(channel = 0; channel < CHANNELS; channel++){
+      stats->estimated_error[channel] = context->estimated_error[channel];
+   }
+   stats->importance_coverage = context->params.importance ? context->importance.coverage : 1;
+   stats->hit_weight = nebulaHitWeight(&context->params);
+   stats->survivors = atomic_load(&context->survivors.output_records);
+}
+
+// Watches a running job, checking its budget and estimating its noise each
+// time the sample count grows by CHECKPOINT_RATIO, and stops the search stage once
+// either limit is reached. With only a time budget there is no snapshot.
+static void monitorConvergence(nebula_context *context, double start){
+   render_params *params = &context->params;
+   long long *snapshot = params->target_error > 0 ? calloc(nebulaHistogramLength(params), sizeof(long long)) : NULL;
+   long snapshot_samples = 0, next_checkpoint = CHECKPOINT_SAMPLES, traced;
+   double error[CHANNELS], worst;
+   int channel;
+
+   if(snapshot == NULL && params->target_error > 0){
+      nebProgress(context, "No memory for convergence checks, running to the sample limit\n");
+      params->target_error = 0;
+   }
+
+   while(atomic_load(&context->searchers_running) > 0){
+      usleep(MONITOR_INTERVAL);
+      if(params->time_budget > 0 && nebWallClock() - start >= params->time_budget){
+         stopSampling(context, "budget");
+         break;
+      }
+      traced = atomic_load(&context->samples_traced);
+      if(snapshot == NULL || traced < next_checkpoint){
+         continue;
+      }
+      if(checkpointError(context, snapshot, snapshot_samples, traced, error) == TRUE){
+         worst = 0;
+         for(channel = 0; channel < CHANNELS; channel++){
+            context->estimated_error[channel] = error[channel];
+            if(error[channel] > worst){
+               worst = error[channel];
+            }
+         }
+         nebProgress(context, "%6ld samples, estimated error %.4f %.4f %.4f\n",
+            traced, error[0], error[1], error[2]);
+         if(params->target_error > 0 && worst <= params->target_error){
+            stopSampling(context, "target");
+            break;
+         }
+      }
+      snapshot_samples = traced;
+      next_checkpoint = traced * CHECKPOINT_RATIO;
+   }
+   free(snapshot);
+}
+
+// Compares the live histogram with the snapshot from the last checkpoint,
+// then replaces the snapshot. Between M and N samples the normalized
+// histograms differ by (N - M) / N of the independent samples since, so the
+// RMS change scaled by sqrt(M / (N - M)) estimates the RMS error at N.
+// Gives the relative error per channel, or FALSE if there was no snapshot.
+static int checkpointError(nebula_context *context, long long *snapshot, long snapshot_samples,
+      long samples, double *error){
+   long long *hit_counter = context->hit_counter;
+   size_t pixel, pixels = (size_t)context->params.width * context->params.height;
+   double total[CHANNELS] = {0}, snapshot_total[CHANNELS] = {0};
+   double difference[CHANNELS] = {0}, norm[CHANNELS] = {0};
+   long long count;
+   int channel;
+
+   // Splat workers keep writing, so every read is atomic
+   syncReplicas(context);
+   for(pixel = 0; pixel < pixels; pixel++){
+      for(channel = 0; channel < CHANNELS; channel++){
+         total[channel] += __atomic_load_n(&hit_counter[pixel * CHANNELS + channel], __ATOMIC_RELAXED);
+         snapshot_total[channel] += snapshot[pixel * CHANNELS + channel];
+      }
+   }
+   for(pixel = 0; pixel < pixels; pixel++){
+      for(channel = 0; channel < CHANNELS; channel++){
+         count = __atomic_load_n(&hit_counter[pixel * CHANNELS + channel], __ATOMIC_RELAXED);
+         if(total[channel] > 0 && snapshot_total[channel] > 0){
+            double now = count / total[channel];
+            double before = snapshot[pixel * CHANNELS + channel] / snapshot_total[channel];
+            difference[channel] += (now - before) * (now - before);
+            norm[channel] += now * now;
+         }
+         snapshot[pixel * CHANNELS + channel] = count;
+      }
+   }
+
+   if(snapshot_samples == 0 || samples <= snapshot_samples){
+      return FALSE;
+   }
+   for(channel = 0; channel < CHANNELS; channel++){
+      error[channel] = norm[channel] > 0
+         ? sqrt(difference[channel] / norm[channel] * snapshot_samples / (samples - snapshot_samples))
+         : 0;
+   }
+   return TRUE;
+}
+
+// Moves what the replicas gathered into the histogram. Each cell is swapped
+// out for zero, so splat workers may keep adding to the replicas meanwhile.
+static void syncReplicas(nebula_context *context){
+   size_t cells = nebulaHistogramLength(&context->params), i;
+   long long count;
+   int replica;
+
+   for(replica = 0; replica < context->replicas; replica++){
+      for(i = 0; i < cells; i++){
+         if(__atomic_load_n(&context->replica[replica][i], __ATOMIC_RELAXED) != 0){
+            count = __atomic_exchange_n(&context->replica[replica][i], 0, __ATOMIC_RELAXED);
+            __atomic_fetch_add(&context->hit_counter[i], count, __ATOMIC_RELAXED);
+         }
+      }
+   }
+}
+
+// Hands out no more samples, queued ones are still traced
+static void stopSampling(nebula_context *context, const char *reason){
+   atomic_store(&context->stop_reason, reason);
+   atomic_store(&context->sample_limit, atomic_load(&context->samples_claimed));
+   nebProgress(context, "Stopping: %s reached\n", reason);
+}
+
+// Runs one search batch and queues its accepted points. While the ring is
+// full the caller traces queued points itself rather than sitting idle.
+// Returns FALSE once every sample has been handed out, or every survivor.
+static int searchAndPush(nebula_context *context, unsigned long long *seed, long long *hit_counter){
+   candidate batch[SEARCH_BATCH];
+   int found = drawBatch(context, seed, batch);
+   int i;
+
+   for(i = 0; i < found; i++){
+      if(atomic_fetch_add(&context->samples_claimed, 1) >= atomic_load(&context->sample_limit)){
+         nebKeepUntraced(context, batch + i, found - i);
+         return FALSE;
+      }
+      while(ringPush(&context->ring, &batch[i]) == FALSE){
+         if(splatOne(context, hit_counter) == FALSE){
+            sched_yield();
+         }
+      }
+   }
+   return atomic_load(&context->samples_claimed) < atomic_load(&context->sample_limit)
+      && nebSurvivorsLeft(context);
+}
+
+// Draws a batch of new candidates, or carries on the next records of the
+// survivors table being resumed
+static int drawBatch(nebula_context *context, unsigned long long *seed, candidate *accepted){
+   if(context->survivors.input != NULL){
+      return nebResumeBatch(context, seed, accepted);
+   }
+   return context->kernel->searchBatch(context, seed, accepted);
+}
+
+// Traces one queued point into the given histogram or replica, returns
+// FALSE if the ring was empty
+static int splatOne(nebula_context *context, long long *hit_counter){
+   candidate next;
+   long traced;
+
+   if(ringPop(&context->ring, &next) == FALSE){
+      return FALSE;
+   }
+   context->kernel->orbitTrace(context, &next, hit_counter);
+   traced = atomic_fetch_add(&context->samples_traced, 1) + 1;
+   if(traced%TICKER == 0 && context->params.max_samples > 0){
+      nebProgress(context, "%6ld / %ld\n", traced, context->params.max_samples);
+   } else if(traced%TICKER == 0){
+      nebProgress(context, "%6ld\n", traced);
+   }
+   return TRUE;
+}
+
+// Starts a worker pinned to its CPU, or unpinned if it can't be pinned
+// there. Returns FALSE if no thread could be started.
+static int startWorker(worker *self, void *(*run)(void *)){
+   pthread_attr_t attributes;
+   int failed;
+
+   nebPinnedAttributes(&attributes, self->cpu);
+   failed = pthread_create(&self->thread, &attributes, run, self);
+   pthread_attr_destroy(&attributes);
+   if(failed && self->cpu >= 0){
+      self->cpu = -1;
+      failed = pthread_create(&self->thread, NULL, run, self);
+   }
+   return failed == 0;
+}
+
+static void *searchWorker(void *arg){
+   worker *self = arg;
+
+   while(searchAndPush(self->context, &self->seed, self->hit_counter) == TRUE){
+      while(self->alone && splatOne(self->context, self->hit_counter) == TRUE);
+   }
+
+   atomic_fetch_sub(&self->context->searchers_running, 1);
+   return NULL;
+}
+
+// Drains the ring until the search stage has finished. An idle splat worker
+// runs a search batch of its own so the splat stage never starves.
+static void *splatWorker(void *arg){
+   worker *self = arg;
+   nebula_context *context = self->context;
+   int finished;
+
+   while(TRUE){
+      finished = atomic_load(&context->searchers_running) == 0;
+      if(splatOne(context, self->hit_counter) == TRUE){
+         continue;
+      }
+      if(finished){
+         break;
+      }
+      if(atomic_load(&context->samples_claimed) < atomic_load(&context->sample_limit)){
+         searchAndPush(context, &self->seed, self->hit_counter);
+      } else {
+         sched_yield();
+      }
+   }
+   return NULL;
+}
+
+static void ringInit(candidate_ring *ring){
+   size_t i;
+   for(i = 0; i < RING_SIZE; i++){
+      atomic_init(&ring->cells[i].sequence, i);
+   }
+   atomic_init(&ring->head, 0);
+   atomic_init(&ring->tail, 0);
+}
+
+static int ringPush(candidate_ring *ring, const candidate *value){
+   size_t position = atomic_load_explicit(&ring->head, memory_order_relaxed);
+   ring_cell *cell;
+   intptr_t diff;
+
+   while(TRUE){
+      cell = &ring->cells[position & (RING_SIZE - 1)];
+      diff = (intptr_t)atomic_load_explicit(&cell->sequence, memory_order_acquire) - (intptr_t)position;
+      if(diff == 0){
+         if(atomic_compare_exchange_weak_explicit(&ring->head, &position, position + 1,
+               memory_order_relaxed, memory_order_relaxed)){
+            cell->value = *value;
+            atomic_store_explicit(&cell->sequence, position + 1, memory_order_release);
+            return TRUE;
+         }
+      } else if(diff < 0){
+         return FALSE;
+      } else {
+         position = atomic_load_explicit(&ring->head, memory_order_relaxed);
+      }
+   }
+}
+
+static int ringPop(candidate_ring *ring, candidate *value){
+   size_t position = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+   ring_cell *cell;
+   intptr_t diff;
+
+   while(TRUE){
+      cell = &ring->cells[position & (RING_SIZE - 1)];
+      diff = (intptr_t)atomic_load_explicit(&cell->sequence, memory_order_acquire) - (intptr_t)(position + 1);
+      if(diff == 0){
+         if(atomic_compare_exchange_weak_explicit(&ring->tail, &position, position + 1,
+               memory_order_relaxed, memory_order_relaxed)){
+            *value = cell->value;
+            atomic_store_explicit(&cell->sequence, position + RING_SIZE, memory_order_release);
+            return TRUE;
+         }
+      } else if(diff < 0){
+         return FALSE;
+      } else {
+         position = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+      }
+   }
+}
+
+// Worker threads to start, one per core unless more or fewer are requested
+int nebWorkerCount(int requested){
+   int threads = requested > 0 ? requested : sysconf(_SC_NPROCESSORS_ONLN);
+   if(threads < 1){
+      threads = 1;
+   }
+   if(threads > MAX_WORKERS){
+      threads = MAX_WORKERS;
+   }
+   return threads;
+}
+
+// Progress lines, only printed for verbose jobs
+void nebProgress(const nebula_context *context, const char *format, ...){
+   va_list args;
+
+   if(context->params.verbose == FALSE){
+      return;
+   }
+   va_start(args, format);
+   vprintf(format, args);
+   va_end(args);
+}
+
+// xorshift64* generator, rand() is shared between threads
+unsigned long long nebRandomBits(unsigned long long *seed){
+   unsigned long long x = *seed;
+   x ^= x >> 12;
+   x ^= x << 25;
+   x ^= x >> 27;
+   *seed = x;
+   return x * 0x2545F4914F6CDD1DULL;
+}
+
+long double nebRandomUnit(unsigned long long *seed){
+   return (long double)(nebRandomBits(seed) >> 11) / (long double)(1ULL << 53);
+}
+
+double nebWallClock(){
+   struct timespec now;
+   clock_gettime(CLOCK_MONOTONIC, &now);
+   return now.tv_sec + now.tv_nsec * 1e-9;
+}
@@ -0,0 +1,334 @@
+/*************************************************/
+/*             NebulaBrot Sampling               */
+/*************************************************/
+
+// How each job draws c: uniform, scrambled low-discrepancy sequences,
+// stratified jitter, and the importance map over all of them
+
+#include <stdlib.h>
+#include <stdio.h>
+
+#include "internal.h"
+
+// Rows of the importance prepass grid probed by one thread
+typedef struct _prepass_worker {
+   pthread_t thread;
+   const render_params *params;
+   int first_row;
+   int last_row;
+   int *accepted;
+   int *shortest;
+   int *longest;
+   int started;
+} prepass_worker;
+
+static void *prepassWorker(void *arg);
+
+
+// Draws fresh scrambles for the low-discrepancy samplers and restarts them
+void nebSequenceInit(nebula_context *context, unsigned long long *seed){
+   sequence_state *sequence = &context->sequence;
+   unsigned long long direction, scrambled, rows[SEQUENCE_BITS];
+   int dimension, bit, k, digit, swap;
+   unsigned char held;
+
+   atomic_store(&sequence->next_index, 0);
+
+   // Dimension 0 is the van der Corput sequence, dimension 1 uses the
+   // primitive polynomial x + 1 and dimension 2 x^2 + x + 1, starting from
+   // 1/2 and 3/4. All are scrambled by a random lower triangular matrix,
+   // then shifted by random digits.
+   for(dimension = 0; dimension < SEQUENCE_DIMENSIONS; dimension++){
+      unsigned long long *directions = sequence->sobol_direction[dimension];
+      direction = 1ULL << (SEQUENCE_BITS - 1);
+      for(k = 0; k < SEQUENCE_BITS; k++){
+         if(dimension == 0){
+            direction = 1ULL << (SEQUENCE_BITS - 1 - k);
+         } else if(dimension == 1 && k > 0){
+            direction ^= direction >> 1;
+         } else if(dimension == 2 && k == 1){
+            direction = 3ULL << (SEQUENCE_BITS - 2);
+         } else if(dimension == 2 && k > 1){
+            direction = directions[k - 1] ^ directions[k - 2] ^ (directions[k - 2] >> 2);
+         }
+         directions[k] = direction;
+      }
+      // Output digit b depends on input digit b and the digits above it
+      for(bit = 0; bit < SEQUENCE_BITS; bit++){
+         rows[bit] = 1ULL << bit | (nebRandomBits(seed) & ~((2ULL << bit) - 1));
+      }
+      for(k = 0; k < SEQUENCE_BITS; k++){
+         scrambled = 0;
+         for(bit = 0; bit < SEQUENCE_BITS; bit++){
+            if(__builtin_parityll(rows[bit] & sequence->sobol_direction[dimension][k])){
+               scrambled |= 1ULL << bit;
+            }
+         }
+         sequence->sobol_direction[dimension][k] = scrambled;
+      }
+      sequence->sobol_shift[dimension] = nebRandomBits(seed);
+   }
+
+   // Independent random permutation of the digits at every position
+   for(k = 0; k < SEQUENCE_BITS; k++){
+      digit = nebRandomUnit(seed) < 0.5;
+      sequence->halton_2[k][0] = digit;
+      sequence->halton_2[k][1] = !digit;
+   }
+   for(k = 0; k < HALTON_DIGITS_3; k++){
+      for(digit = 0; digit < 3; digit++){
+         sequence->halton_3[k][digit] = digit;
+      }
+      for(digit = 2; digit > 0; digit--){
+         swap = nebRandomUnit(seed) * (digit + 1);
+         held = sequence->halton_3[k][digit];
+         sequence->halton_3[k][digit] = sequence->halton_3[k][swap];
+         sequence->halton_3[k][swap] = held;
+      }
+   }
+   for(k = 0; k < HALTON_DIGITS_5; k++){
+      for(digit = 0; digit < 5; digit++){
+         sequence->halton_5[k][digit] = digit;
+      }
+      for(digit = 4; digit > 0; digit--){
+         swap = nebRandomUnit(seed) * (digit + 1);
+         held = sequence->halton_5[k][digit];
+         sequence->halton_5[k][digit] = sequence->halton_5[k][swap];
+         sequence->halton_5[k][swap] = held;
+      }
+   }
+}
+
+// Escape-time prepass over a coarse grid of the sampling square, turned
+// into an alias table of cells with the inverse-probability weight of each.
+// Returns FALSE if memory runs out or no cell can hold an accepted point.
+int nebBuildImportanceMap(nebula_context *context){
+   const render_params *params = &context->params;
+   importance_map *importance = &context->importance;
+   prepass_worker workers[MAX_WORKERS];
+   int size = IMPORTANCE_GRID, cells = IMPORTANCE_GRID * IMPORTANCE_GRID;
+   int probes = IMPORTANCE_PROBES * IMPORTANCE_PROBES;
+   int *accepted = calloc(cells, sizeof(int));
+   int *shortest = calloc(cells, sizeof(int));
+   int *longest = calloc(cells, sizeof(int));
+   int *small = malloc(cells * sizeof(int));
+   int *large = malloc(cells * sizeof(int));
+   double *share = malloc(cells * sizeof(double));
+   double total = 0, uniform_rate = 0, importance_rate = 0;
+   int threads, cell, x, y, dx, dy, near, low, high, small_count = 0, large_count = 0, contributing = 0;
+   int reach = params->min_orbital_length * IMPORTANCE_REACH;
+   int built = FALSE;
+
+   importance->size = size;
+   importance->probability = malloc(cells * sizeof(double));
+   importance->alias = malloc(cells * sizeof(int));
+   importance->weight = malloc(cells * sizeof(double));
+   if(!(accepted && shortest && longest && small && large && share
+         && importance->probability && importance->alias && importance->weight)){
+      goto done;
+   }
+
+   threads = nebWorkerCount(params->threads);
+   nebProgress(context, "Importance prepass over %dx%d cells...\n", size, size);
+   for(x = 0; x < threads; x++){
+      workers[x].params = params;
+      workers[x].first_row = size * x / threads;
+      workers[x].last_row = size * (x + 1) / threads;
+      workers[x].accepted = accepted;
+      workers[x].shortest = shortest;
+      workers[x].longest = longest;
+      // Rows a thread can't be started for are run here
+      workers[x].started = pthread_create(&workers[x].thread, NULL, prepassWorker, &workers[x]) == 0;
+      if(workers[x].started == FALSE){
+         prepassWorker(&workers[x]);
+      }
+   }
+   for(x = 0; x < threads; x++){
+      if(workers[x].started){
+         pthread_join(workers[x].thread, NULL);
+      }
+   }
+
+   // A cell can only hold an accepted point if its neighbourhood has points
+   // that escape late enough and points that escape at all
+   for(y = 0; y < size; y++){
+      for(x = 0; x < size; x++){
+         cell = y * size + x;
+         low = FALSE;
+         high = FALSE;
+         for(dy = -1; dy <= 1; dy++){
+            for(dx = -1; dx <= 1; dx++){
+               if(x + dx < 0 || x + dx >= size || y + dy < 0 || y + dy >= size){
+                  continue;
+               }
+               near = (y + dy) * size + x + dx;
+               low = low || shortest[near] <= params->max_orbital_length;
+               high = high || longest[near] > reach;
+            }
+         }
+         share[cell] = 0;
+         if(accepted[cell] > 0 || (low && high)){
+            share[cell] = accepted[cell] + IMPORTANCE_FLOOR;
+            contributing++;
+         }
+         total += share[cell];
+         uniform_rate += (double)accepted[cell] / probes / cells;
+      }
+   }
+   if(total <= 0){
+      goto done;
+   }
+
+   // Vose's alias method, cells above the mean donate to those below it.
+   // Every cell keeps a spread share, so none is left out.
+   for(cell = 0; cell < cells; cell++){
+      share[cell] = (1 - IMPORTANCE_SPREAD) * share[cell] / total + IMPORTANCE_SPREAD / cells;
+      importance_rate += share[cell] * accepted[cell] / probes;
+      importance->weight[cell] = 1 / (share[cell] * cells);
+      share[cell] *= cells;
+      if(share[cell] < 1){
+         small[small_count++] = cell;
+      } else {
+         large[large_count++] = cell;
+      }
+   }
+   while(small_count > 0 && large_count > 0){
+      int less = small[--small_count];
+      int more = large[--large_count];
+      importance->probability[less] = share[less];
+      importance->alias[less] = more;
+      share[more] -= 1 - share[less];
+      if(share[more] < 1){
+         small[small_count++] = more;
+      } else {
+         large[large_count++] = more;
+      }
+   }
+   while(large_count > 0){
+      cell = large[--large_count];
+      importance->probability[cell] = 1;
+      importance->alias[cell] = cell;
+   }
+   while(small_count > 0){
+      cell = small[--small_count];
+      importance->probability[cell] = 1;
+      importance->alias[cell] = cell;
+   }
+
+   importance->coverage = (double)contributing / cells;
+   nebProgress(context, "Importance map: %.1f%% of cells favoured, estimated acceptance %.2e -> %.2e\n",
+      100 * importance->coverage, uniform_rate, importance_rate);
+   built = TRUE;
+
+done:
+   if(built == FALSE){
+      nebFreeImportanceMap(context);
+   }
+   free(accepted);
+   free(shortest);
+   free(longest);
+   free(small);
+   free(large);
+   free(share);
+   return built;
+}
+
+// Probes each cell on a regular sub-grid, recording how many probes land in
+// the orbital window and the shortest and longest orbit seen. Excluded
+// probes count as never escaping.
+static void *prepassWorker(void *arg){
+   prepass_worker *self = arg;
+   const render_params *params = self->params;
+   int size = IMPORTANCE_GRID;
+   int x, y, a, b, cell, orbital_length;
+   neb_complex c;
+
+   for(y = self->first_row; y < self->last_row; y++){
+      for(x = 0; x < size; x++){
+         cell = y * size + x;
+         self->shortest[cell] = params->max_orbital_length + 1;
+         self->longest[cell] = 0;
+         for(b = 0; b < IMPORTANCE_PROBES; b++){
+            for(a = 0; a < IMPORTANCE_PROBES; a++){
+               c.real = RAND_RANGE*(2.0 * (x + (a + 0.5) / IMPORTANCE_PROBES) / size - 1.0);
+               c.imag = RAND_RANGE*(2.0 * (y + (b + 0.5) / IMPORTANCE_PROBES) / size - 1.0);
+               if(nebCheckExclusions(c, params->exclusions) == FALSE){
+                  orbital_length = params->max_orbital_length + 1;
+               } else {
+                  orbital_length = nebOrbitalLength(c, params->max_orbital_length);
+               }
+               if(orbital_length < params->max_orbital_length && orbital_length > params->min_orbital_length){
+                  self->accepted[cell]++;
+               }
+               if(orbital_length < self->shortest[cell]){
+                  self->shortest[cell] = orbital_length;
+               }
+               if(orbital_length > self->longest[cell]){
+                  self->longest[cell] = orbital_length;
+               }
+            }
+         }
+      }
+   }
+   return NULL;
+}
+
+void nebFreeImportanceMap(nebula_context *context){
+   importance_map *importance = &context->importance;
+
+   free(importance->probability);
+   free(importance->alias);
+   free(importance->weight);
+   importance->probability = NULL;
+   importance->alias = NULL;
+   importance->weight = NULL;
+   importance->size = 0;
+}
+
+// Scrambled radical inverses of SEARCH_BATCH consecutive indices. The digits
+// of the first index are expanded once, then carried forward one at a time.
+void nebRadicalInverseBatch(unsigned long long index, int base, int digits,
+      const unsigned char *permutation, long double *values){
+   unsigned char digit[SEQUENCE_BITS];
+   long double scale[SEQUENCE_BITS], weight = 1.0L / base, value = 0;
+   int i, k;
+
+   for(k = 0; k < digits; k++){
+      digit[k] = index % base;
+      index /= base;
+      scale[k] = weight;
+      value += permutation[k * base + digit[k]] * weight;
+      weight /= base;
+   }
+   for(i = 0; i < SEARCH_BATCH; i++){
+      values[i] = value;
+      for(k = 0; k < digits; k++){
+         value -= permutation[k * base + digit[k]] * scale[k];
+         digit[k] = digit[k] + 1 == base ? 0 : digit[k] + 1;
+         value += permutation[k * base + digit[k]] * scale[k];
+         if(digit[k] != 0){
+            break;
+         }
+      }
+   }
+}
+
+// SEARCH_BATCH Sobol points in Gray code order, which covers the same points
+// as index order within each aligned block and needs one XOR per point
+void nebSobolBatch(const sequence_state *sequence, unsigned long long index, int dimension,
+      long double *values){
+   const unsigned long long *direction = sequence->sobol_direction[dimension];
+   unsigned long long gray = index ^ (index >> 1);
+   unsigned long long point = sequence->sobol_shift[dimension];
+   int i, k;
+
+   for(k = 0; gray != 0; k++, gray >>= 1){
+      if(gray & 1){
+         point ^= direction[k];
+      }
+   }
+   for(i = 0; i < SEARCH_BATCH; i++){
+      values[i] = point * 0x1p-64L;
+      point ^= direction[__builtin_ctzll(index + i + 1)];
+   }
+}
@@ -0,0 +1,239 @@
+/*************************************************/
+/*              NebulaBrot Job Survey            */
+/*************************************************/
+
+// Sizes a job before it runs: the vector escape test on one jittered point
+// per stratum of the sampling square gives the orbit length distribution and
+// how much of the square each window accepts, and timing the job's own
+// kernels for a moment turns that into a projected run time.
+
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+#include "internal.h"
+
+// Seconds the job's search kernel is timed for, and the most accepted
+// survey orbits timed through its trace kernel
+#define SURVEY_TIMING 0.25
+#define SURVEY_TRACED 1000
+
+typedef struct _survey_worker {
+   pthread_t thread;
+   int started;
+   const render_params *params;
+   int strata;                   // Per axis
+   atomic_int *next_row;
+   unsigned long long seed;
+   nebula_survey counts;         // This worker's share, summed afterwards
+   long long splats;
+   long long adds;
+   candidate *traced;            // Accepted orbits kept for timing
+   atomic_int *traced_count;
+} survey_worker;
+
+static void *surveyWorker(void *arg);
+static void surveyLanes(survey_worker *self, const double *real, const double *imag, int count);
+static void timeKernels(const render_params *params, candidate *traced, int count, nebula_survey *survey);
+
+
+// One point per stratum of an strata x strata grid over the sampling square
+int nebulaSurvey(const nebula_params *params, long probes, nebula_survey *survey){
+   survey_worker workers[MAX_WORKERS];
+   candidate *traced = malloc(SURVEY_TRACED * sizeof(candidate));
+   atomic_int next_row, traced_count;
+   int strata = ceil(sqrt(probes > 0 ? probes : 1));
+   int threads = nebWorkerCount(params->threads), i, k, channel;
+   long long splats = 0, adds = 0;
+   double start = nebWallClock();
+   unsigned long long seed = params->seed ? params->seed : ((unsigned long long)start << 20) | 1;
+   long accepted;
+
+   memset(survey, 0, sizeof(*survey));
+   if(traced == NULL || nebulaValidParams(params) == FALSE){
+      free(traced);
+      return FALSE;
+   }
+   atomic_init(&next_row, 0);
+   atomic_init(&traced_count, 0);
+   if(threads > strata){
+      threads = strata;
+   }
+   for(i = 0; i < threads; i++){
+      memset(&workers[i], 0, sizeof(workers[i]));
+      workers[i].params = params;
+      workers[i].strata = strata;
+      workers[i].next_row = &next_row;
+      workers[i].seed = (seed + i * 0x9E3779B97F4A7C15ULL) | 1;
+      workers[i].traced = traced;
+      workers[i].traced_count = &traced_count;
+      workers[i].started = pthread_create(&workers[i].thread, NULL, surveyWorker, &workers[i]) == 0;
+   }
+
+   // Rows left over by workers that couldn't be started are surveyed here
+   for(i = 0; i < threads; i++){
+      if(workers[i].started == FALSE){
+         surveyWorker(&workers[i]);
+      } else {
+         pthread_join(workers[i].thread, NULL);
+      }
+      survey->probes += workers[i].counts.probes;
+      survey->excluded += workers[i].counts.excluded;
+      survey->bounded += workers[i].counts.bounded;
+      survey->accepted += workers[i].counts.accepted;
+      for(k = 0; k < NEBULA_SURVEY_BUCKETS; k++){
+         survey->lengths[k] += workers[i].counts.lengths[k];
+      }
+      for(channel = 0; channel < CHANNELS; channel++){
+         survey->channel_acceptance[channel] += workers[i].counts.channel_acceptance[channel];
+      }
+      splats += workers[i].splats;
+      adds += workers[i].adds;
+   }
+
+   accepted = survey->accepted;
+   survey->acceptance = (double)accepted / survey->probes;
+   survey->acceptance_error = accepted > 0
+      ? sqrt(survey->acceptance * (1 - survey->acceptance) / survey->probes)
+      : 3.0 / survey->probes;
+   for(channel = 0; channel < CHANNELS; channel++){
+      survey->channel_acceptance[channel] /= survey->probes;
+   }
+   survey->splats_per_orbit = accepted > 0 ? (double)splats / accepted : 0;
+   survey->adds_per_orbit = accepted > 0 ? (double)adds / accepted : 0;
+
+   timeKernels(params, traced, atomic_load(&traced_count) < SURVEY_TRACED
+      ? atomic_load(&traced_count) : SURVEY_TRACED, survey);
+   survey->threads = nebWorkerCount(params->threads);
+   survey->projected_seconds = -1;
+   if(accepted > 0 && params->max_samples > 0 && survey->orbit_seconds >= 0){
+      survey->projected_seconds = params->max_samples
+         * (survey->probe_seconds / survey->acceptance + survey->orbit_seconds) / survey->threads;
+   }
+   survey->seconds = nebWallClock() - start;
+   free(traced);
+   return TRUE;
+}
+
+static void *surveyWorker(void *arg){
+   survey_worker *self = arg;
+   const render_params *params = self->params;
+   double real[ESCAPE_LANES], imag[ESCAPE_LANES];
+   int row, column, count;
+   neb_complex c;
+
+   while((row = atomic_fetch_add(self->next_row, 1)) < self->strata){
+      count = 0;
+      for(column = 0; column < self->strata; column++){
+         c.real = RAND_RANGE * (2.0 * (column + nebRandomUnit(&self->seed)) / self->strata - 1.0);
+         c.imag = RAND_RANGE * (2.0 * (row + nebRandomUnit(&self->seed)) / self->strata - 1.0);
+         self->counts.probes++;
+         if(nebCheckExclusions(c, params->exclusions) == FALSE){
+            self->counts.excluded++;
+            continue;
+         }
+         real[count] = c.real;
+         imag[count] = c.imag;
+         if(++count == ESCAPE_LANES){
+            surveyLanes(self, real, imag, count);
+            count = 0;
+         }
+      }
+      if(count > 0){
+         surveyLanes(self, real, imag, count);
+      }
+   }
+   return NULL;
+}
+
+// Escape test of up to ESCAPE_LANES points, the rest of the lanes padded
+// with a point that escapes at once
+static void surveyLanes(survey_worker *self, const double *real, const double *imag, int count){
+   const render_params *params = self->params;
+   double padded_real[ESCAPE_LANES], padded_imag[ESCAPE_LANES];
+   int lengths[ESCAPE_LANES], lane, length, bucket, channel, index;
+
+   for(lane = 0; lane < ESCAPE_LANES; lane++){
+      padded_real[lane] = lane < count ? real[lane] : MAX_SQUARE_DIST;
+      padded_imag[lane] = lane < count ? imag[lane] : 0;
+   }
+   nebEscapeLengths(padded_real, padded_imag, lengths, params->max_orbital_length);
+
+   for(lane = 0; lane < count; lane++){
+      length = lengths[lane];
+      if(length > params->max_orbital_length){
+         self->counts.bounded++;
+         continue;
+      }
+      for(bucket = 0; bucket < NEBULA_SURVEY_BUCKETS - 1 && (2LL << bucket) <= length; bucket++);
+      self->counts.lengths[bucket]++;
+      if(length >= params->max_orbital_length || length <= params->min_orbital_length){
+         continue;
+      }
+
+      // Accepted, counted in channels as orbitTrace() counts them, and the
+      // orbit splats every point before it escapes
+      self->counts.accepted++;
+      self->splats += length - 1;
+      for(channel = 0; channel < CHANNELS; channel++){
+         if(channelCounts(length, params->channel_min[channel], params->channel_max[channel],
+               params->min_orbital_length, params->max_orbital_length)){
+            self->counts.channel_acceptance[channel]++;
+            self->adds += length - 1;
+         }
+      }
+      if(atomic_load(self->traced_count) < SURVEY_TRACED){
+         index = atomic_fetch_add(self->traced_count, 1);
+         if(index < SURVEY_TRACED){
+            self->traced[index].c.real = real[lane];
+            self->traced[index].c.imag = imag[lane];
+            self->traced[index].orbital_length = length;
+            self->traced[index].weight = 1;
+         }
+      }
+   }
+}
+
+// Times the job's own search kernel for SURVEY_TIMING seconds, and its trace
+// kernel on the kept orbits into a scratch histogram, on this thread
+static void timeKernels(const render_params *params, candidate *traced, int count, nebula_survey *survey){
+   render_params job = *params;
+   long long *scratch;
+   nebula_context *context;
+   candidate accepted[SEARCH_BATCH];
+   unsigned long long seed = 1;
+   double start;
+   long batches = 0;
+   int i;
+
+   survey->probe_seconds = -1;
+   survey->orbit_seconds = -1;
+   job.importance = FALSE;
+   job.verbose = FALSE;
+   scratch = calloc(nebulaHistogramLength(&job), sizeof(long long));
+   context = scratch ? nebulaCreate(&job, scratch) : NULL;
+   if(context == NULL){
+      free(scratch);
+      return;
+   }
+   nebSequenceInit(context, &seed);
+
+   start = nebWallClock();
+   do {
+      context->kernel->searchBatch(context, &seed, accepted);
+      batches++;
+   } while(nebWallClock() - start < SURVEY_TIMING);
+   survey->probe_seconds = (nebWallClock() - start) / (batches * SEARCH_BATCH);
+
+   // Written through first, so page faults don't count as trace time
+   if(count > 0){
+      memset(scratch, 0, nebulaHistogramLength(&job) * sizeof(long long));
+      start = nebWallClock();
+      for(i = 0; i < count; i++){
+         context->kernel->orbitTrace(context, &traced[i], scratch);
+      }
+      survey->orbit_seconds = (nebWallClock() - start) / count;
+   }
+   nebulaDestroy(context);
+   free(scratch);
+}
@@ -0,0 +1,266 @@
+/*************************************************/
+/*           NebulaBrot Survivors Table          */
+/*************************************************/
+
+// Orbits still bounded when a run's orbital window closes, kept so a run
+// with a higher cap carries them on from where they stopped instead of
+// iterating them again from z = 0. A table is a fixed header followed by
+// one fixed size record per orbit:
+//
+//    "NBS1" mantissa_bits record_bytes reserved records
+//    (c.real c.imag z.real z.imag orbital_length weight)...
+//
+// z and orbital_length are as nebContinueOrbit() left them, so an orbit that
+// escaped on the last iteration is kept with z past the escape radius.
+// Accepted orbits a run drew but never traced are kept from z = 0. Long
+// doubles keep only their significant bytes, in host order, so a table
+// reads back on machines with the same long double.
+
+#include <stdlib.h>
+#include <string.h>
+#include <float.h>
+#include <stdint.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "internal.h"
+
+// Bytes a long double is stored in, the x87 format uses 10 of its 16
+#if LDBL_MANT_DIG == 64
+#define LONG_DOUBLE_BYTES 10
+#else
+#define LONG_DOUBLE_BYTES sizeof(long double)
+#endif
+
+// c, z, orbital length and weight
+#define RECORD_BYTES (4 * LONG_DOUBLE_BYTES + sizeof(int32_t) + sizeof(double))
+
+typedef struct _survivors_header {
+   char magic[4];                // "NBS1"
+   int32_t mantissa_bits;        // LDBL_MANT_DIG of the writer
+   int32_t record_bytes;
+   int32_t reserved;
+   int64_t records;
+} survivors_header;
+
+static int writeHeader(survivor_table *table);
+static void closeOutput(survivor_table *table);
+static void putRecord(unsigned char *record, const survivor *orbit);
+static void getRecord(const unsigned char *record, survivor *orbit);
+
+
+// Starts a new table, the orbits the context's following runs outlast their
+// window with are added to it
+int nebulaKeepSurvivors(nebula_context *context, const char *filename){
+   survivor_table *table = &context->survivors;
+   FILE *file = fopen(filename, "wb");
+
+   if(file == NULL){
+      return FALSE;
+   }
+   closeOutput(table);
+   table->output = file;
+   atomic_store(&table->output_records, 0);
+   return writeHeader(table);
+}
+
+int nebulaResumeSurvivors(nebula_context *context, const char *filename){
+   survivor_table *table = &context->survivors;
+   survivors_header header;
+   struct stat status;
+   void *mapped = MAP_FAILED;
+   int fd = open(filename, O_RDONLY);
+
+   if(fd >= 0 && fstat(fd, &status) == 0 && pread(fd, &header, sizeof(header), 0) == sizeof(header)
+         && memcmp(header.magic, "NBS1", 4) == 0 && header.mantissa_bits == LDBL_MANT_DIG
+         && header.record_bytes == RECORD_BYTES && header.records >= 0
+         && (size_t)status.st_size == sizeof(header) + (size_t)header.records * RECORD_BYTES){
+      mapped = mmap(NULL, status.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+   }
+   if(fd >= 0){
+      close(fd);
+   }
+   if(mapped == MAP_FAILED){
+      return FALSE;
+   }
+   madvise(mapped, status.st_size, MADV_SEQUENTIAL);
+   if(table->input != NULL){
+      munmap((void *)table->input, table->input_length);
+   }
+   table->input = mapped;
+   table->input_length = status.st_size;
+   table->input_records = header.records;
+   atomic_store(&table->next_record, 0);
+
+   // Carrying orbits on costs differently from drawing them, so the stages
+   // are timed again
+   context->search_share = -1;
+   return TRUE;
+}
+
+// Carries the next SEARCH_BATCH records of the table on to the cap. Those
+// now inside the orbital window are accepted, with their weight in fixed
+// point as the search kernels give it, and those still outlasting it are
+// kept again.
+int nebResumeBatch(nebula_context *context, unsigned long long *seed, candidate *accepted){
+   const render_params *params = &context->params;
+   survivor_table *table = &context->survivors;
+   survivor orbit, kept[SEARCH_BATCH];
+   long long record = atomic_fetch_add(&table->next_record, SEARCH_BATCH);
+   long long last = record + SEARCH_BATCH < table->input_records ? record + SEARCH_BATCH : table->input_records;
+   double scaled;
+   int found = 0, survivors = 0;
+
+   for(; record < last; record++){
+      getRecord(table->input + sizeof(survivors_header) + record * RECORD_BYTES, &orbit);
+      if(nebModulusSquared(orbit.z) <= MAX_SQUARE_DIST){
+         orbit.orbital_length = nebContinueOrbit(orbit.c, &orbit.z, orbit.orbital_length,
+            params->max_orbital_length);
+      }
+      if(orbit.orbital_length >= params->max_orbital_length){
+         kept[survivors++] = orbit;
+      } else if(orbit.orbital_length > params->min_orbital_length){
+         accepted[found].c = orbit.c;
+         accepted[found].orbital_length = orbit.orbital_length;
+
+         // Rounded up with the probability of the fraction, as in the search
+         scaled = orbit.weight * (params->importance ? IMPORTANCE_WEIGHT : 1);
+         accepted[found].weight = scaled;
+         if(scaled > accepted[found].weight && nebRandomUnit(seed) < scaled - accepted[found].weight){
+            accepted[found].weight++;
+         }
+         found++;
+      }
+   }
+   nebKeepSurvivors(context, kept, survivors);
+   return found;
+}
+
+// Whether the search stage has anything left to draw
+int nebSurvivorsLeft(nebula_context *context){
+   survivor_table *table = &context->survivors;
+   return table->input == NULL || atomic_load(&table->next_record) < table->input_records;
+}
+
+// Adds up to SEARCH_BATCH orbits to the table being kept, if there is one
+void nebKeepSurvivors(nebula_context *context, const survivor *kept, int count){
+   survivor_table *table = &context->survivors;
+   unsigned char records[SEARCH_BATCH * RECORD_BYTES];
+   int i;
+
+   if(table->output == NULL || count == 0){
+      return;
+   }
+   for(i = 0; i < count; i++){
+      putRecord(records + i * RECORD_BYTES, &kept[i]);
+   }
+
+   // One write per batch, stdio keeps the batches of different workers whole
+   if(fwrite(records, RECORD_BYTES, count, table->output) == (size_t)count){
+      atomic_fetch_add(&table->output_records, count);
+   }
+}
+
+// Accepted orbits a run stopped before tracing, kept from the start so the
+// table and the histogram between them cover every draw
+void nebKeepUntraced(nebula_context *context, const candidate *orbits, int count){
+   survivor kept[SEARCH_BATCH];
+   int i;
+
+   if(context->survivors.output == NULL){
+      return;
+   }
+   for(i = 0; i < count; i++){
+      memset(&kept[i], 0, sizeof(kept[i]));
+      kept[i].c = orbits[i].c;
+      kept[i].orbital_length = 1;
+      kept[i].weight = (double)orbits[i].weight / (context->params.importance ? IMPORTANCE_WEIGHT : 1);
+   }
+   nebKeepSurvivors(context, kept, count);
+}
+
+// Ends a run. A table resumed only part way is left to the next run, unless
+// survivors are kept, when the records it never reached are copied over
+// unchanged. Returns FALSE if the kept table could not be written.
+int nebFinishSurvivors(nebula_context *context){
+   survivor_table *table = &context->survivors;
+   long long next = atomic_load(&table->next_record), left = table->input_records - next;
+
+   if(table->output == NULL){
+      return TRUE;
+   }
+   if(table->input != NULL && left > 0){
+      if(fwrite(table->input + sizeof(survivors_header) + next * RECORD_BYTES, RECORD_BYTES, left,
+            table->output) == (size_t)left){
+         atomic_fetch_add(&table->output_records, left);
+      }
+      atomic_store(&table->next_record, table->input_records);
+   }
+   return writeHeader(table);
+}
+
+void nebCloseSurvivors(nebula_context *context){
+   survivor_table *table = &context->survivors;
+
+   closeOutput(table);
+   if(table->input != NULL){
+      munmap((void *)table->input, table->input_length);
+      table->input = NULL;
+   }
+}
+
+static void closeOutput(survivor_table *table){
+   if(table->output != NULL){
+      writeHeader(table);
+      fclose(table->output);
+      table->output = NULL;
+   }
+}
+
+// Rewrites the header with the records written so far, so the table reads
+// back between runs
+static int writeHeader(survivor_table *table){
+   survivors_header header;
+
+   memset(&header, 0, sizeof(header));
+   memcpy(header.magic, "NBS1", 4);
+   header.mantissa_bits = LDBL_MANT_DIG;
+   header.record_bytes = RECORD_BYTES;
+   header.records = atomic_load(&table->output_records);
+   return fflush(table->output) == 0 && fseek(table->output, 0, SEEK_SET) == 0
+      && fwrite(&header, sizeof(header), 1, table->output) == 1
+      && fseek(table->output, 0, SEEK_END) == 0 && fflush(table->output) == 0
+      && ferror(table->output) == 0;
+}
+
+static void putRecord(unsigned char *record, const survivor *orbit){
+   long double values[4] = {orbit->c.real, orbit->c.imag, orbit->z.real, orbit->z.imag};
+   int32_t orbital_length = orbit->orbital_length;
+   int i;
+
+   for(i = 0; i < 4; i++){
+      memcpy(record + i * LONG_DOUBLE_BYTES, &values[i], LONG_DOUBLE_BYTES);
+   }
+   memcpy(record + 4 * LONG_DOUBLE_BYTES, &orbital_length, sizeof(orbital_length));
+   memcpy(record + 4 * LONG_DOUBLE_BYTES + sizeof(orbital_length), &orbit->weight, sizeof(orbit->weight));
+}
+
+static void getRecord(const unsigned char *record, survivor *orbit){
+   long double values[4];
+   int32_t orbital_length;
+   int i;
+
+   memset(values, 0, sizeof(values));
+   for(i = 0; i < 4; i++){
+      memcpy(&values[i], record + i * LONG_DOUBLE_BYTES, LONG_DOUBLE_BYTES);
+   }
+   memcpy(&orbital_length, record + 4 * LONG_DOUBLE_BYTES, sizeof(orbital_length));
+   memcpy(&orbit->weight, record + 4 * LONG_DOUBLE_BYTES + sizeof(orbital_length), sizeof(orbit->weight));
+   orbit->c.real = values[0];
+   orbit->c.imag = values[1];
+   orbit->z.real = values[2];
+   orbit->z.imag = values[3];
+   orbit->orbital_length = orbital_length;
+}